@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+
+/*
+ * Throughput benchmarks of libwapiti
+ *
+ * Labels a corpus with a model, and/or ingests training data and runs
+ * a few iterations of each trainer on it. Results are printed as one
+ * JSON object per line, so runs can be collected and compared over
+ * time. Run through "make bench BENCH_ARGS=...", see usage below.
+ */
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: wapiti-bench [options]\n"
+    "  -m FILE   model to label with, text or binary\n"
+    "  -c FILE   corpus to label, sequences separated by empty lines\n"
+    "  -t N      labeling threads                          [1]\n"
+    "  -r N      passes over the corpus                    [1]\n"
+    "  -p FILE   patterns to train with\n"
+    "  -d FILE   labeled training data\n"
+    "  -i N      iterations of each trainer                [5]\n"
+    "  -T TYPE   model type to train                       [crf]\n");
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Reads a whole file in a NUL terminated string */
+static char *slurp(const char *filename) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  size_t len = 0, size = 1 << 16;
+  char *buf = malloc(size);
+  for (;;) {
+    len += fread(buf + len, 1, size - len - 1, file);
+    if (len < size - 1)
+      break;
+    size *= 2;
+    buf = realloc(buf, size);
+  }
+  buf[len] = '\0';
+  fclose(file);
+  return buf;
+}
+
+/* Sequences of a BIO file, split in place at the empty lines */
+typedef struct corpus_s {
+  char     *buf;
+  char    **seqs;
+  uint32_t *toks;
+  uint32_t  cnt;
+  uint64_t  ntok;
+} corpus_t;
+
+static corpus_t *corpus_load(const char *filename) {
+  corpus_t *cps = malloc(sizeof(corpus_t));
+  cps->buf = slurp(filename);
+  cps->cnt = 0;
+  cps->ntok = 0;
+  uint32_t size = 1024;
+  cps->seqs = malloc(sizeof(char *) * size);
+  cps->toks = malloc(sizeof(uint32_t) * size);
+  char *cur = cps->buf;
+  while (*cur != '\0') {
+    while (*cur == '\n')
+      cur++;
+    if (*cur == '\0')
+      break;
+    if (cps->cnt == size) {
+      size *= 2;
+      cps->seqs = realloc(cps->seqs, sizeof(char *) * size);
+      cps->toks = realloc(cps->toks, sizeof(uint32_t) * size);
+    }
+    // The sequence goes up to the next empty line, its final newline
+    // is kept
+    char *seq = cur;
+    uint32_t T = 0;
+    while (*cur != '\0' && *cur != '\n') {
+      T++;
+      cur += strcspn(cur, "\n");
+      if (*cur == '\n')
+        cur++;
+    }
+    if (*cur == '\n')
+      *cur++ = '\0';
+    cps->seqs[cps->cnt] = seq;
+    cps->toks[cps->cnt++] = T;
+    cps->ntok += T;
+  }
+  return cps;
+}
+
+static void corpus_free(corpus_t *cps) {
+  free(cps->buf);
+  free(cps->seqs);
+  free(cps->toks);
+  free(cps);
+}
+
+/* Labeling work shared between threads, sequences are taken in turn */
+typedef struct lab_s {
+  mdl_t    *mdl;
+  corpus_t *cps;
+  uint64_t  next, total;
+  uint64_t *lat;          // [total]  latency of each call
+} lab_t;
+
+static void *lab_worker(void *ud) {
+  lab_t *lab = ud;
+  for (;;) {
+    const uint64_t n = __atomic_fetch_add(&lab->next, 1, __ATOMIC_RELAXED);
+    if (n >= lab->total)
+      return NULL;
+    const char *seq = lab->cps->seqs[n % lab->cps->cnt];
+    const uint64_t t0 = now();
+    char *res = api_label_seq(lab->mdl, seq);
+    lab->lat[n] = now() - t0;
+    free(res);
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_label(const char *model, const char *corpus,
+                        uint32_t nthread, uint32_t passes, opt_t *opt) {
+  uint64_t t0 = now();
+  mdl_t *mdl = api_load_model((char *)model, opt);
+  const double load = (now() - t0) / 1e9;
+  corpus_t *cps = corpus_load(corpus);
+  if (cps->cnt == 0) {
+    fprintf(stderr, "%s: no sequences\n", corpus);
+    exit(EXIT_FAILURE);
+  }
+
+  lab_t lab = {mdl, cps, 0, (uint64_t)cps->cnt * passes, NULL};
+  lab.lat = malloc(sizeof(uint64_t) * lab.total);
+  pthread_t *th = malloc(sizeof(pthread_t) * nthread);
+  t0 = now();
+  for (uint32_t i = 0; i < nthread; i++)
+    pthread_create(&th[i], NULL, lab_worker, &lab);
+  for (uint32_t i = 0; i < nthread; i++)
+    pthread_join(th[i], NULL);
+  const double secs = (now() - t0) / 1e9;
+  free(th);
+
+  qsort(lab.lat, lab.total, sizeof(uint64_t), cmp_u64);
+  const uint64_t p50 = lab.lat[lab.total / 2];
+  const uint64_t p99 = lab.lat[min(lab.total - 1, lab.total * 99 / 100)];
+  const uint64_t ntok = cps->ntok * passes;
+  printf("{\"bench\":\"label\",\"threads\":%"PRIu32",\"seqs\":%"PRIu64","
+         "\"toks\":%"PRIu64",\"load_s\":%.6f,\"secs\":%.6f,"
+         "\"toks_per_s\":%.1f,\"seqs_per_s\":%.1f,"
+         "\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+         nthread, lab.total, ntok, load, secs, ntok / secs,
+         lab.total / secs, p50 / 1e3, p99 / 1e3);
+  fflush(stdout);
+  free(lab.lat);
+  corpus_free(cps);
+  api_free_model(mdl);
+}
+
+static mdl_t *bench_ingest(opt_t *opt, const char *pats, corpus_t *cps,
+                           double *secs) {
+  mdl_t *mdl = api_new_model(opt, pats);
+  const uint64_t t0 = now();
+  for (uint32_t s = 0; s < cps->cnt; s++)
+    api_add_train_seq(mdl, cps->seqs[s]);
+  *secs = (now() - t0) / 1e9;
+  return mdl;
+}
+
+/* The distinct trainers of wapiti, the other names are variants */
+static const char *trainers[] = {"l-bfgs", "sgd-l1", "bcd", "rprop"};
+
+static void bench_train(const char *patterns, const char *data,
+                        uint32_t iters, opt_t *opt) {
+  char *pats = slurp(patterns);
+  corpus_t *cps = corpus_load(data);
+  double secs;
+  mdl_t *mdl = bench_ingest(opt, pats, cps, &secs);
+  printf("{\"bench\":\"ingest\",\"seqs\":%"PRIu32",\"toks\":%"PRIu64","
+         "\"secs\":%.6f,\"toks_per_s\":%.1f}\n",
+         cps->cnt, cps->ntok, secs, cps->ntok / secs);
+  fflush(stdout);
+  api_free_model(mdl);
+
+  for (size_t a = 0; a < sizeof(trainers) / sizeof(trainers[0]); a++) {
+    opt->algo = (char *)trainers[a];
+    opt->maxiter = iters;
+    mdl = bench_ingest(opt, pats, cps, &secs);
+    // Trainers can stop before maxiter, so the iterations actually done
+    // are polled from the training handle
+    const struct timespec nap = {0, 100000};
+    const uint64_t t0 = now();
+    api_trn_t *trn = api_train_async(mdl, NULL);
+    uint32_t it;
+    while (!api_train_done(trn, &it))
+      nanosleep(&nap, NULL);
+    secs = (now() - t0) / 1e9;
+    api_train_wait(trn);
+    printf("{\"bench\":\"train\",\"algo\":\"%s\",\"threads\":%"PRIu32","
+           "\"iters\":%"PRIu32",\"secs\":%.6f,\"secs_per_iter\":%.6f}\n",
+           trainers[a], opt->nthread, it, secs, it > 0 ? secs / it : 0.0);
+    fflush(stdout);
+    api_free_model(mdl);
+  }
+  corpus_free(cps);
+  free(pats);
+}
+
+int main(int argc, char *argv[]) {
+  const char *model = NULL, *corpus = NULL, *patterns = NULL, *data = NULL;
+  uint32_t nthread = 1, passes = 1, iters = 5;
+  opt_t opt = opt_defaults;
+  int c;
+  while ((c = getopt(argc, argv, "m:c:t:r:p:d:i:T:")) != -1) {
+    switch (c) {
+      case 'm': model = optarg; break;
+      case 'c': corpus = optarg; break;
+      case 't': nthread = max(atoi(optarg), 1); break;
+      case 'r': passes = max(atoi(optarg), 1); break;
+      case 'p': patterns = optarg; break;
+      case 'd': data = optarg; break;
+      case 'i': iters = max(atoi(optarg), 1); break;
+      case 'T': opt.type = optarg; break;
+      default: usage();
+    }
+  }
+  if ((model == NULL) != (corpus == NULL))
+    usage();
+  if ((patterns == NULL) != (data == NULL))
+    usage();
+  if (model == NULL && patterns == NULL)
+    usage();
+
+  // Trainer progress would mix with the results
+  api_set_log_level(WARNING);
+  opt.nthread = nthread;
+  if (model != NULL)
+    bench_label(model, corpus, nthread, passes, &opt);
+  if (patterns != NULL)
+    bench_train(patterns, data, iters, &opt);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "sequence.h"
+#include "tools.h"
+#include "api.h"
+#include "arena.h"
+#include "mdlext.h"
+
+/*
+ * Active-set training
+ *
+ * With an L1 penalty, most weights end up and stay at 0 after a few
+ * iterations, but the gradient still goes over every observation of
+ * every sequence. In active-set mode, every period-th gradient is a
+ * full pass, after which an observation is left out if all its weights
+ * are 0 and none of its partial derivatives is larger than rho1, so the
+ * optimality conditions hold for it and the trainer would leave it at
+ * 0. The gradients in between are computed on a copy of the training
+ * sequences without those observations, which gets faster as the model
+ * gets sparser.
+ *
+ * Observations left out have no weight so the scores, and thus the
+ * objective, are exactly the same, only their derivatives are not
+ * computed and read as 0. Should one of their weights move anyway, the
+ * next gradient is a full pass. Only trainers going through
+ * grd_gradient use it, l-bfgs and rprop, and only with rho1 > 0.
+ */
+struct act_s {
+  dat_t    *full;         // Training set of the model
+  dat_t     dat;          // Same sequences restricted to active observations
+  arn_t    *arena;        // Storage of the restricted sequences
+  bool     *off;          // [O]  observations left out
+  uint64_t  calls;        // Gradients computed so far
+  bool      scan;         // Whether the current one rebuilds the set
+};
+
+/* Size of the restricted sequences arena chunks */
+#define act_arnsz (8 << 20)
+
+/*
+ * Trains on the active set, with a full pass every period gradient
+ * computations. 0 turns it off, it only applies to the next trainings.
+ */
+void api_set_active(mdl_t *mdl, uint32_t period) {
+  mdl_ext(mdl)->aperiod = period;
+}
+
+/* Releases the active set, at the end of a training */
+void act_free(mdl_t *mdl) {
+  act_t *act = mdl_ext(mdl)->act;
+  if (act == NULL)
+    return;
+  if (act->arena != NULL)
+    arn_free(act->arena);
+  free(act->dat.seq);
+  free(act->off);
+  free(act);
+  mdl_ext(mdl)->act = NULL;
+}
+
+/* Whether all weights of the block are 0 with small partial derivatives */
+static bool act_idle(const double x[], const double g[], uint64_t n,
+                     double rho1) {
+  for (uint64_t i = 0; i < n; i++)
+    if (x[i] != 0.0 || fabs(g[i]) > rho1)
+      return false;
+  return true;
+}
+
+/* Whether a weight of an observation left out is no longer 0 */
+static bool act_moved(mdl_t *mdl, const act_t *act) {
+  const uint64_t Y = mdl->nlbl, O = mdl->nobs;
+  const double *x = mdl->theta;
+  for (uint64_t o = 0; o < O; o++) {
+    if (!act->off[o])
+      continue;
+    if (mdl->kind[o] & 1)
+      for (uint64_t y = 0; y < Y; y++)
+        if (x[mdl->uoff[o] + y] != 0.0)
+          return true;
+    if (mdl->kind[o] & 2)
+      for (uint64_t d = 0; d < Y * Y; d++)
+        if (x[mdl->boff[o] + d] != 0.0)
+          return true;
+  }
+  return false;
+}
+
+/*
+ * Rebuilds the active set from the gradient of a full pass, and the
+ * copy of the training sequences without the observations left out.
+ */
+static void act_shrink(mdl_t *mdl, act_t *act, const double g[]) {
+  const uint64_t Y = mdl->nlbl, O = mdl->nobs;
+  const double rho1 = mdl->opt->rho1;
+  const double *x = mdl->theta;
+  uint64_t nact = 0;
+  for (uint64_t o = 0; o < O; o++) {
+    bool off = true;
+    if (mdl->kind[o] & 1)
+      off = act_idle(x + mdl->uoff[o], g + mdl->uoff[o], Y, rho1);
+    if (off && (mdl->kind[o] & 2))
+      off = act_idle(x + mdl->boff[o], g + mdl->boff[o], Y * Y, rho1);
+    act->off[o] = off;
+    nact += !off;
+  }
+  info("* Active set: %"PRIu64" of %"PRIu64" observations\n", nact, O);
+
+  if (act->arena != NULL)
+    arn_free(act->arena);
+  act->arena = NULL;
+  free(act->dat.seq);
+  act->dat.seq = NULL;
+  if (nact == O)
+    return;
+
+  // Same layout as ext_addseq, with the positions kept and their
+  // observations filtered
+  const dat_t *dat = act->full;
+  act->arena = arn_new(act_arnsz);
+  act->dat = *dat;
+  act->dat.seq = xmalloc(sizeof(seq_t *) * (dat->nseq + 1));
+  for (uint32_t s = 0; s < dat->nseq; s++) {
+    const seq_t *src = dat->seq[s];
+    const uint32_t T = src->len;
+    size_t size = 0;
+    for (uint32_t t = 0; t < T; t++) {
+      const pos_t *pos = &src->pos[t];
+      for (uint32_t i = 0; i < pos->ucnt; i++)
+        size += !act->off[pos->uobs[i]];
+      for (uint32_t i = 0; i < pos->bcnt; i++)
+        size += !act->off[pos->bobs[i]];
+    }
+    const size_t hdr = sizeof(seq_t) + sizeof(pos_t) * T;
+    seq_t *seq = arn_alloc(act->arena, hdr + sizeof(uint64_t) * size);
+    seq->len = T;
+    seq->raw = (uint64_t *)((char *)seq + hdr);
+    uint64_t *tmp = seq->raw;
+    for (uint32_t t = 0; t < T; t++) {
+      const pos_t *from = &src->pos[t];
+      pos_t *pos = &seq->pos[t];
+      pos->lbl = from->lbl;
+      pos->uobs = tmp;
+      for (uint32_t i = 0; i < from->ucnt; i++)
+        if (!act->off[from->uobs[i]])
+          *tmp++ = from->uobs[i];
+      pos->ucnt = tmp - pos->uobs;
+      pos->bobs = tmp;
+      for (uint32_t i = 0; i < from->bcnt; i++)
+        if (!act->off[from->bobs[i]])
+          *tmp++ = from->bobs[i];
+      pos->bcnt = tmp - pos->bobs;
+    }
+    act->dat.seq[s] = seq;
+  }
+}
+
+/*
+ * Called before each gradient computation. Returns true if the training
+ * set was swapped for its restricted copy, false for a full pass.
+ */
+bool act_enter(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->aperiod == 0 || mdl->opt->rho1 <= 0.0)
+    return false;
+  act_t *act = ext->act;
+  if (act == NULL) {
+    act = xmalloc(sizeof(act_t));
+    act->full = mdl->train;
+    act->dat.seq = NULL;
+    act->arena = NULL;
+    act->off = xmalloc(sizeof(bool) * (mdl->nobs + 1));
+    act->calls = 0;
+    ext->act = act;
+  }
+  act->scan = act->calls++ % ext->aperiod == 0;
+  if (act->scan || act->dat.seq == NULL)
+    return false;
+  if (act_moved(mdl, act)) {
+    act->scan = true;
+    return false;
+  }
+  mdl->train = &act->dat;
+  return true;
+}
+
+/*
+ * Called after each gradient computation with its final value, puts the
+ * training set back, or rebuilds the active set after a full pass.
+ */
+void act_leave(mdl_t *mdl, const double g[], bool shrunk) {
+  act_t *act = mdl_ext(mdl)->act;
+  if (act == NULL)
+    return;
+  if (shrunk)
+    mdl->train = act->full;
+  else if (act->scan)
+    act_shrink(mdl, act, g);
+}
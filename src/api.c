@@ -18,36 +18,57 @@
 #include "api.h"
 #include "progress.h"
 #include "trainers.h"
+#include "simd.h"
+#include "context.h"
+#include "mdlext.h"
 
 
 /* To maintain c99 compatibility.. */
-static char *strdup(const char *str)
+static char *strndup(const char *str, size_t len)
 {
-  char *cpy = NULL;
-  if (str)
+  char *cpy = malloc(len+1);
+  if (cpy)
   {
-    cpy = malloc(strlen(str)+1);
-    if (cpy)
-      strcpy(cpy, str);
+    memcpy(cpy, str, len);
+    cpy[len] = '\0';
   }
   return cpy;
 }
 
+/*
+ * Reentrant replacement for the strtok calls on newlines. Skips empty
+ * lines, stores the length of the next line in len and moves the
+ * cursor past it. Returns NULL when there are no more lines. The input
+ * string is never modified, so the same buffer can be split from
+ * several threads at once.
+ */
+static const char *api_nextline(const char **cursor, size_t *len) {
+  const char *line = *cursor;
+  while (*line == '\n')
+    line++;
+  if (*line == '\0')
+    return NULL;
+  *len = strcspn(line, "\n");
+  *cursor = line + *len;
+  return line;
+}
+
 /* Converts a BIO-formatted string to a raw sequence type */
-static raw_t *api_str2raw(char *seq) {
+static raw_t *api_str2raw(const char *seq) {
   int size = 32; // Initial number of lines in raw_t
   int cnt = 0;
-  char *line;
+  const char *line;
+  size_t len;
 
   raw_t *raw = xmalloc(sizeof(raw_t) + sizeof(char *) * size);
 
-  for (line = strtok(seq, "\n") ; line ; line = strtok(NULL, "\n")) {
+  while ((line = api_nextline(&seq, &len)) != NULL) {
     // Make sure there's room and add the line
     if (cnt == size) {
       size *= 1.4;
       raw = xrealloc(raw, sizeof(raw_t) + sizeof(char *) * size);
     }
-    raw->lines[cnt++] = strdup(line);
+    raw->lines[cnt++] = strndup(line, len);
   }
   raw->len = cnt;
   return raw;
@@ -82,6 +103,7 @@ static const struct {
 } trn_lst[] = {
 	{"l-bfgs", trn_lbfgs},
 	{"sgd-l1", trn_sgdl1},
+	{"sgd-l1-par", trn_sgdl1par},
 	{"bcd",    trn_bcd  },
 	{"rprop",  trn_rprop},
 	{"rprop+", trn_rprop},
@@ -92,8 +114,15 @@ static const int trn_cnt = sizeof(trn_lst) / sizeof(trn_lst[0]);
 
 
 /* Initializes model  */
-mdl_t *api_new_model(opt_t *options, char *patterns) {
-  mdl_t *mdl = mdl_new(rdr_new(options->maxent));
+mdl_t *api_new_model(opt_t *options, const char *patterns) {
+  // Move the new model into a wrapper with room for our own state,
+  // see mdlext.h
+  mdl_t *tmp = mdl_new(rdr_new(options->maxent));
+  mdl_ext_t *ext = xmalloc(sizeof(mdl_ext_t));
+  memset(ext, 0, sizeof(mdl_ext_t));
+  memcpy(&ext->mdl, tmp, sizeof(mdl_t));
+  free(tmp);
+  mdl_t *mdl = &ext->mdl;
   mdl->opt = options;
 
   // Make sure the selected model type is valid
@@ -121,142 +150,384 @@ mdl_t *api_new_model(opt_t *options, char *patterns) {
   return mdl;
 }
 
-/* Initializes a model and loads data from model file */
+/*
+ * Initializes a model and loads data from model file. Binary model
+ * files, see api_save_model_binary, are mapped instead of parsed.
+ */
 mdl_t *api_load_model(char *filename, opt_t *options) {
   mdl_t *mdl = api_new_model(options, NULL);
 
   FILE *file = fopen(filename, "r");
   if (file == NULL)
     pfatal("cannot open input model file: %s", filename);
-  mdl_load(mdl, file);
+  if (bin_check(file)) {
+    fclose(file);
+    bin_load(mdl, filename);
+    ext_compile(mdl);
+    return mdl;
+  }
+  txt_load(mdl, file);
+  fclose(file);
+  ext_compile(mdl);
+
+  // Lock the dictionaries so labeling never adds to them. This makes
+  // the model read-only, and safe to share between labeling threads.
+  qrk_lock(mdl->reader->lbl, true);
+  qrk_lock(mdl->reader->obs, true);
   return mdl;
 }
 
+/* Splits, builds and decodes a sequence in the context buffers */
+static void api_decode(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len) {
+  if (sts_on(mdl)) {
+    sts_decode(mdl, ctx, buf, len);
+    return;
+  }
+  ctx_split(ctx, buf, len, mdl->opt->check);
+  if (lbc_get(mdl, ctx))
+    return;
+  ctx_raw2seq(mdl, ctx, mdl->opt->check);
+  ctx_viterbi(mdl, ctx);
+  lbc_put(mdl, ctx);
+}
+
 /*
  * Splits a raw BIO-formatted string into lines, annotates them and
  * returns a copy of input string with an added label column.
+ *
+ * The input string is left untouched and the model is only read, so
+ * any number of threads can label with the same loaded or trained
+ * model at once.
+ */
+char *api_label_seq(mdl_t *mdl, const char *lines) {
+  api_ctx_t *ctx = api_new_ctx();
+  api_label_seq_ctx(mdl, ctx, lines);
+  char *lblseq = strndup(ctx->str, ctx->slen);
+  api_free_ctx(ctx);
+  return lblseq;
+}
+
+/*
+ * Same as api_label_seq, but all memory comes from the given context
+ * and the returned string belongs to it, valid until the next call
+ * with the same context. Use one context per thread.
+ */
+const char *api_label_seq_ctx(mdl_t *mdl, api_ctx_t *ctx, const char *lines) {
+  api_decode(mdl, ctx, lines, strlen(lines));
+  if (sts_on(mdl))
+    return sts_output(mdl, ctx);
+  return ctx_output(mdl, ctx);
+}
+
+/*
+ * Labels the first len chars of a BIO-formatted buffer, which doesn't
+ * need to be NUL terminated and is neither copied nor modified. The
+ * label ids of the first size positions are stored in lbls, and the
+ * length of the sequence is returned, so a caller with a too short
+ * array can tell.
+ */
+uint32_t api_label_ids(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                       uint32_t lbls[], uint32_t size) {
+  api_decode(mdl, ctx, buf, len);
+  memcpy(lbls, ctx->out, sizeof(uint32_t) * min(ctx->len, size));
+  return ctx->len;
+}
+
+/* Same as api_label_ids, but stores the label names */
+uint32_t api_label_strs(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                        const char *lbls[], uint32_t size) {
+  api_decode(mdl, ctx, buf, len);
+  for (uint32_t t = 0; t < min(ctx->len, size); t++)
+    lbls[t] = qrk_id2str(mdl->reader->lbl, ctx->out[t]);
+  return ctx->len;
+}
+
+/*
+ * Labels a sequence of T positions of C columns already split by the
+ * caller, the cell of column c at position t being cells[t * C + c],
+ * with the last column the label in check mode. No input string is
+ * parsed and the cells are read in place by the pattern program. The
+ * labels are stored like api_label_ids. This does not go through the
+ * label cache, which is keyed by input lines.
+ */
+uint32_t api_label_cols(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                        uint32_t T, uint32_t C, uint32_t lbls[],
+                        uint32_t size) {
+  if (sts_on(mdl)) {
+    sts_columns(mdl, ctx, cells, T, C);
+  } else {
+    ctx_columns(ctx, cells, T, C, mdl->opt->check);
+    ctx_raw2seq(mdl, ctx, mdl->opt->check);
+    ctx_viterbi(mdl, ctx);
+  }
+  memcpy(lbls, ctx->out, sizeof(uint32_t) * min(ctx->len, size));
+  return ctx->len;
+}
+
+/*
+ * Labels a buffer like api_label_ids, but keeps the n best paths in the
+ * context and, if post is set, the posterior probability of each label
+ * at each position, computed with forward-backward. Results are read
+ * with the functions below and stay valid until the next call with the
+ * same context. Returns the number of paths found.
+ */
+uint32_t api_label_nbest(mdl_t *mdl, api_ctx_t *ctx, const char *buf,
+                         size_t len, uint32_t n, bool post) {
+  if (sts_on(mdl))
+    return sts_nbest(mdl, ctx, buf, len, n, post);
+  ctx_split(ctx, buf, len, mdl->opt->check);
+  ctx_raw2seq(mdl, ctx, mdl->opt->check);
+  return ctx_nbest(mdl, ctx, n, post);
+}
+
+/* Returns the length of the last sequence labeled with the context */
+uint32_t api_ctx_length(const api_ctx_t *ctx) {
+  return ctx->len;
+}
+
+/*
+ * Returns the labels of the i-th best path, one per position, and
+ * stores its score in score if not NULL. Returns NULL if there is no
+ * such path.
+ */
+const uint32_t *api_nbest_labels(const api_ctx_t *ctx, uint32_t i,
+                                 double *score) {
+  if (i >= ctx->nbn)
+    return NULL;
+  if (score != NULL)
+    score[0] = ctx->nsc[(size_t)ctx->len * ctx->nblbl * ctx->nbmax + i];
+  return ctx->npath + (size_t)i * ctx->len;
+}
+
+/*
+ * Returns the posterior probabilities of all labels at position t,
+ * indexed by label id, or NULL if they were not requested.
+ */
+const double *api_nbest_marginals(const api_ctx_t *ctx, uint32_t t) {
+  if (!ctx->post || t >= ctx->len)
+    return NULL;
+  return ctx->alpha + (size_t)t * smd_padded(ctx->nblbl);
+}
+
+/* Returns the number of labels known by the model */
+uint32_t api_label_count(mdl_t *mdl) {
+  return qrk_count(mdl->reader->lbl);
+}
+
+/*
+ * Returns the name of a label id. The string belongs to the model and
+ * stays valid until it is freed.
  */
-char *api_label_seq(mdl_t *mdl, char *lines) {
-    size_t outsize = strlen(lines);
-	qrk_t *lbls = mdl->reader->lbl;
-    raw_t *raw = api_str2raw(lines);
-	seq_t *seq = rdr_raw2seq(mdl->reader, raw, mdl->opt->check);
-	const int T = seq->len;
-
-	uint32_t *out = xmalloc(sizeof(uint32_t) * T);
-	double *psc = xmalloc(sizeof(double) * T);
-	double *scs = xmalloc(sizeof(double));
-
-    tag_viterbi(mdl, seq, out, scs, psc);
-
-    // Allocate some intial memory for the output string.
-    // Account for the input string + a little extra per line for
-    // label and whitespace
-    outsize += 5 * T;
-    char *lblseq = xmalloc(outsize);
-    const char *lblstr;
-    size_t rowsize;
-    size_t pos = 0;
-
-	// Build the output string
-    for (int t = 0; t < T; t++) {
-      lblstr = qrk_id2str(lbls, out[t]);
-      // Size: input line  + \t + label + \n + \0
-      rowsize = strlen(raw->lines[t]) + strlen(lblstr) + 3;
-      if (pos+rowsize > outsize) {
-        outsize += rowsize*(T-t);
-        lblseq = xrealloc(lblseq, outsize);
-      }
-      pos += snprintf(lblseq+pos, outsize-pos, "%s\t%s\n", raw->lines[t], lblstr);
+const char *api_label_name(mdl_t *mdl, uint32_t id) {
+  return qrk_id2str(mdl->reader->lbl, id);
+}
+
+/* Work shared by all the workers of a labeling batch */
+typedef struct bat_s {
+  mdl_t        *mdl;
+  const char  **seqs;
+  char        **results;
+  uint32_t     *order;    // Sequences sorted by decreasing length
+} bat_t;
+
+/* And the private part of each worker */
+typedef struct bat_wrk_s {
+  bat_t        *bat;
+  api_ctx_t    *ctx;
+} bat_wrk_t;
+
+typedef struct bat_len_s {
+  size_t        len;
+  uint32_t      idx;
+} bat_len_t;
+
+static int bat_cmp(const void *a, const void *b) {
+  const bat_len_t *x = a, *y = b;
+  if (x->len != y->len)
+    return x->len < y->len ? 1 : -1;
+  return x->idx < y->idx ? -1 : 1;
+}
+
+static void bat_worker(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  bat_wrk_t *wrk = ud;
+  bat_t *bat = wrk->bat;
+  uint32_t pos, n;
+  (void)id;
+  (void)cnt;
+  while (mth_getjob(job, &n, &pos)) {
+    for (uint32_t i = pos; i < pos + n; i++) {
+      const uint32_t s = bat->order[i];
+      api_label_seq_ctx(bat->mdl, wrk->ctx, bat->seqs[s]);
+      bat->results[s] = strndup(wrk->ctx->str, wrk->ctx->slen);
     }
-    // Terminate the output string
-    lblseq[pos] = '\0';
+  }
+}
+
+/*
+ * Labels n BIO-formatted sequences using opt->nthread workers, each
+ * with its own context. Sequences are handed out one at a time,
+ * longest first, so a few long ones can't leave the other workers
+ * idle at the end of the batch. results[i] receives the output of
+ * api_label_seq for seqs[i] and must be freed by the caller.
+ */
+void api_label_batch(mdl_t *mdl, const char *seqs[], uint32_t n, char *results[]) {
+  const uint32_t W = max(min(mdl->opt->nthread, n), 1u);
+  if (n == 0)
+    return;
+
+  // Schedule the longest sequences first
+  bat_len_t *lens = xmalloc(sizeof(bat_len_t) * n);
+  for (uint32_t i = 0; i < n; i++) {
+    lens[i].len = strlen(seqs[i]);
+    lens[i].idx = i;
+  }
+  qsort(lens, n, sizeof(bat_len_t), bat_cmp);
+  uint32_t *order = xmalloc(sizeof(uint32_t) * n);
+  for (uint32_t i = 0; i < n; i++)
+    order[i] = lens[i].idx;
+  free(lens);
+
+  bat_t bat = {mdl, seqs, results, order};
+  bat_wrk_t *wrks = xmalloc(sizeof(bat_wrk_t) * W);
+  void **uds = xmalloc(sizeof(void *) * W);
+  for (uint32_t w = 0; w < W; w++) {
+    wrks[w].bat = &bat;
+    wrks[w].ctx = api_new_ctx();
+    uds[w] = &wrks[w];
+  }
+
+  mth_spawn(bat_worker, W, uds, n, 1);
 
-	// Free memory used for this sequence
-	free(scs);
-	free(psc);
-	free(out);
-	rdr_freeraw(raw);
-	rdr_freeseq(seq);
-    return lblseq;
+  for (uint32_t w = 0; w < W; w++)
+    api_free_ctx(wrks[w].ctx);
+  free(uds);
+  free(wrks);
+  free(order);
 }
 
 
 /* Compiles lines of patterns and stores them in the model */
-void api_load_patterns(mdl_t *mdl, char *lines) {
+void api_load_patterns(mdl_t *mdl, const char *lines) {
   rdr_t *rdr = mdl->reader;
-  for (char *line = strtok(lines, "\n") ; line ; line = strtok(NULL, "\n")) {
+  const char *src;
+  size_t len;
+  while ((src = api_nextline(&lines, &len)) != NULL) {
 
     // Remove comments and trailing spaces
-    int end = strcspn(line, "#");
-    while (end != 0 && isspace(line[end - 1]))
+    size_t end = strcspn(src, "#\n");
+    while (end != 0 && isspace(src[end - 1]))
       end--;
     if (end == 0)
       continue;
 
-    line[end] = '\0';
-    line[0] = tolower(line[0]);
-
     // Avoid messing with the original pattern string
-    char *patstr = strdup(line);
-
-    // Compile pattern and add it to the list
-    pat_t *pat = pat_comp(patstr);
-    rdr->npats++;
-    switch (line[0]) {
-      case 'u': rdr->nuni++; break;
-      case 'b': rdr->nbi++; break;
-      case '*': rdr->nuni++;
-        rdr->nbi++; break;
-      default:
-        fatal("unknown pattern type '%c'", line[0]);
-    }
-    rdr->pats = xrealloc(rdr->pats, sizeof(char *) * rdr->npats);
-    rdr->pats[rdr->npats - 1] = pat;
-    rdr->ntoks = max(rdr->ntoks, pat->ntoks);
+    char *patstr = strndup(src, end);
+    patstr[0] = tolower(patstr[0]);
+    api_addpat(rdr, patstr);
   }
+  ext_compile(mdl);
+  lbc_clear(mdl);
+}
 
+/* Compiles a pattern and adds it to the reader, which owns patstr */
+void api_addpat(rdr_t *rdr, char *patstr) {
+  const char type = patstr[0];
+
+  // Compile pattern and add it to the list
+  pat_t *pat = pat_comp(patstr);
+  rdr->npats++;
+  switch (type) {
+    case 'u': rdr->nuni++; break;
+    case 'b': rdr->nbi++; break;
+    case '*': rdr->nuni++;
+      rdr->nbi++; break;
+    default:
+      fatal("unknown pattern type '%c'", type);
+  }
+  rdr->pats = xrealloc(rdr->pats, sizeof(char *) * rdr->npats);
+  rdr->pats[rdr->npats - 1] = pat;
+  rdr->ntoks = max(rdr->ntoks, pat->ntoks);
 }
 
 /* Adds a sequence of BIO-formatted training data to the model. */
-void api_add_train_seq(mdl_t *mdl, char *lines) {
-  dat_t *dat = mdl->train;
+void api_add_train_seq(mdl_t *mdl, const char *lines) {
+  ext_thaw(mdl);
+  const bool lock = ext_grow(mdl, false);
+  if (mdl_ext(mdl)->hbits != 0) {
+    // Hashed observations never go through the dictionary
+    ext_addlines(mdl, lines, strlen(lines));
+    ext_grow(mdl, lock);
+    return;
+  }
   raw_t *raw = api_str2raw(lines);
   seq_t *seq = rdr_raw2seq(mdl->reader, raw, true);
-
-  // Make room
-  dat->seq = xrealloc(dat->seq, sizeof(seq_t *) * (dat->nseq + 1));
-
-  // And store the sequence
-  dat->seq[dat->nseq++] = seq;
-  dat->mlen = max(dat->mlen, seq->len);
+  rdr_freeraw(raw);
+  ext_grow(mdl, lock);
+  ext_addseq(mdl, seq);
+  rdr_freeseq(seq);
 }
 
-/* Trains the model on loaded training data. */
-void api_train(mdl_t *mdl) {
-
-  // Get the training method
+/* Returns the training method selected in the model options */
+ext_trn_f *ext_trainer(mdl_t *mdl) {
   int trn;
   for (trn = 0; trn < trn_cnt; trn++)
     if (!strcmp(mdl->opt->algo, trn_lst[trn].name))
       break;
   if (trn == trn_cnt)
     fatal("unknown algorithm '%s'", mdl->opt->algo);
+  // Distributed training goes through grd_gradient, see dist.c
+  const api_dist_t *dist = mdl_ext(mdl)->dist;
+  if (dist != NULL && dist->size > 1 && trn_lst[trn].train != trn_lbfgs
+      && trn_lst[trn].train != trn_rprop)
+    fatal("algorithm '%s' cannot train distributed", mdl->opt->algo);
+  return trn_lst[trn].train;
+}
+
+/* Makes a freshly trained model ready for labeling */
+void ext_trained(mdl_t *mdl) {
+  act_free(mdl);
+  lbc_clear(mdl);
 
-  mdl_sync(mdl);            // Finalize model structure for training
+  // Keep the trained model read-only for concurrent labeling
+  qrk_lock(mdl->reader->lbl, true);
+  qrk_lock(mdl->reader->obs, true);
+}
+
+/* Trains the model on loaded training data. */
+void api_train(mdl_t *mdl) {
+  ext_trn_f *train = ext_trainer(mdl);
+  ext_thaw(mdl);
+  ext_sync(mdl);            // Finalize model structure for training
+  ext_schedule(mdl);        // Longest sequences first for the workers
   uit_setup(mdl);           // Setup signal handling to abort training
-  trn_lst[trn].train(mdl);
+  train(mdl);
   uit_cleanup(mdl);
+  ext_trained(mdl);
+}
 
+/*
+ * Continues training a model from its current weights, for at most
+ * maxiter iterations, or opt->maxiter if 0. Training data added to a
+ * loaded or trained model can bring new labels and observations, the
+ * model is extended to them and keeps everything it learned so far.
+ */
+void api_train_warm(mdl_t *mdl, uint32_t maxiter) {
+  const uint32_t keep = mdl->opt->maxiter;
+  if (maxiter != 0)
+    mdl->opt->maxiter = maxiter;
+  api_train(mdl);
+  mdl->opt->maxiter = keep;
 }
 
 /* Saves the model to a file. */
 void api_save_model(mdl_t *mdl, FILE *file) {
-  mdl_save(mdl, file);
+  ext_thaw(mdl);
+  txt_save(mdl, file);
 }
 
 /* Frees all memory used by the model. */
 void api_free_model(mdl_t *mdl) {
+  ext_free(mdl);
   mdl_free(mdl);
 }
 
@@ -286,17 +557,6 @@ void err_log(char *msg) {
   exit(EXIT_FAILURE);
 }
 
-/*
- * The 4 logging levels. FATAL and PFATAL are actually more like final
- * words and and not logging. See wapiti src for more info.
- */
-enum loglvl {
-  FATAL,
-  PFATAL,
-  WARNING,
-  INFO
-};
-
 /* Customize by replacing with logging function pointers */
 void (* api_logs[4])(char *msg) = {
   err_log,
@@ -305,12 +565,23 @@ void (* api_logs[4])(char *msg) = {
   inf_log
 };
 
+/*
+ * Messages above this level are dropped, before they are even
+ * formatted. Fatal messages always get through.
+ */
+static int api_log_level = INFO;
+
+void api_set_log_level(int level) {
+  api_log_level = level;
+}
+
 /*
  * Too avoid bloating this with clever allocation logic, log messages
- * are truncated to 1400 chars. Look, it's 10 tweets!
+ * are truncated to MAXLOGMSG chars. Look, it's 10 tweets! Each thread
+ * formats its messages in its own buffer, so logging never allocates
+ * and threads do not wait on each other, unless the log functions do.
  */
-const int MAXLOGMSG = 1400;
-char *OOMMSG = "out of memory\n";
+static __thread char log_msg[MAXLOGMSG];
 
 /*
  * After fatal log messages the program state should be considered
@@ -320,60 +591,52 @@ char *OOMMSG = "out of memory\n";
  */
 void __wrap_fatal(const char *msg, ...) {
   va_list args;
-  char *message = malloc(MAXLOGMSG);
-  if (message == NULL) {
-    message = OOMMSG;
-  } else {
-    va_start(args, msg);
-    vsnprintf(message, MAXLOGMSG, msg, args);
-    va_end(args);
-  }
-  api_logs[FATAL](message);
+  va_start(args, msg);
+  vsnprintf(log_msg, MAXLOGMSG, msg, args);
+  va_end(args);
+  api_logs[FATAL](log_msg);
 }
 void __wrap_pfatal(const char *msg, ...) {
   va_list args;
   const char *err = strerror(errno);
-  char *message = malloc(MAXLOGMSG + strlen(err) + 4);
-  if (message == NULL) {
-    message = OOMMSG;
-  } else {
-    va_start(args, msg);
-    vsnprintf(message, MAXLOGMSG, msg, args);
-    va_end(args);
-    size_t msglen = strlen(message);
-	snprintf(message+msglen, MAXLOGMSG-msglen, " <%s>", err);
-  }
-  api_logs[PFATAL](message);
+  va_start(args, msg);
+  vsnprintf(log_msg, MAXLOGMSG, msg, args);
+  va_end(args);
+  size_t msglen = strlen(log_msg);
+  snprintf(log_msg + msglen, MAXLOGMSG - msglen, " <%s>", err);
+  api_logs[PFATAL](log_msg);
 }
 
 /*
- * Non-fatal log functions don't need to stop execution, and the error
- * message will be freed after the logs-call
+ * Non-fatal log functions don't need to stop execution. Their messages
+ * go through the log ring when it is on, see logring.c.
  */
 void __wrap_warning(const char *msg, ...) {
+  if (api_log_level < WARNING)
+    return;
   va_list args;
-  char *message = malloc(MAXLOGMSG);
-  if (message == NULL) {
-    message = OOMMSG;
-  } else {
-    va_start(args, msg);
-    vsnprintf(message, MAXLOGMSG, msg, args);
-    va_end(args);
-  }
-  api_logs[WARNING](message);
-  free(message);
+  va_start(args, msg);
+  const bool queued = lgr_push(WARNING, msg, args);
+  va_end(args);
+  if (queued)
+    return;
+  va_start(args, msg);
+  vsnprintf(log_msg, MAXLOGMSG, msg, args);
+  va_end(args);
+  api_logs[WARNING](log_msg);
 }
 void __wrap_info(const char *msg, ...) {
+  if (api_log_level < INFO)
+    return;
   va_list args;
-  char *message = malloc(MAXLOGMSG);
-  if (message == NULL) {
-    message = OOMMSG;
-  } else {
-    va_start(args, msg);
-    vsnprintf(message, MAXLOGMSG, msg, args);
-    va_end(args);
-  }
-  api_logs[INFO](message);
-  free(message);
+  va_start(args, msg);
+  const bool queued = lgr_push(INFO, msg, args);
+  va_end(args);
+  if (queued)
+    return;
+  va_start(args, msg);
+  vsnprintf(log_msg, MAXLOGMSG, msg, args);
+  va_end(args);
+  api_logs[INFO](log_msg);
 }
 
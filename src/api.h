@@ -1,15 +1,171 @@
+#ifndef api_h
+#define api_h
+
 #include "model.h"
 #include "trainers.h"
 
-char *api_label_seq(mdl_t *mdl, char *strseq);
-void api_load_patterns(mdl_t *mdl, char *lines);
-void api_add_train_seq(mdl_t *mdl, char *lines);
+typedef struct api_ctx_s api_ctx_t;
+typedef struct api_reg_s api_reg_t;
+typedef struct api_trn_s api_trn_t;
+typedef struct api_dist_s api_dist_t;
+typedef struct api_evs_s api_evs_t;
+
+/* A piece of the caller's input, not necessarily NUL terminated */
+typedef struct api_span_s {
+  const char *str;
+  uint32_t    len;
+} api_span_t;
+
+/*
+ * Labeling counters, see api_get_stats. Times are in nanoseconds,
+ * spent splitting the input, building its observations, decoding and
+ * formatting the output.
+ */
+typedef struct api_stats_s {
+  uint64_t  seqs;         // Sequences labeled
+  uint64_t  toks;         // Tokens labeled
+  uint64_t  hits;         // Sequences answered by the label cache
+  uint64_t  obs;          // Observations looked up
+  uint64_t  unk;          // Observations unknown to the model
+  uint64_t  split, feat, decode, output;
+} api_stats_t;
+
+/*
+ * Scores of a model on an evaluation set, see api_eval. f1 is averaged
+ * over the labels found or expected at least once.
+ */
+typedef struct api_eval_s {
+  uint64_t  seqs, toks;   // Sequences and tokens evaluated
+  uint64_t  tokerr;       // Tokens labeled wrong
+  uint64_t  seqerr;       // Sequences with at least one of them
+  double    acc;          // Token accuracy
+  double    f1;           // Macro-averaged token F1
+} api_eval_t;
+
+/* Callbacks of api_train_async, all optional */
+typedef struct api_trn_cb_s {
+  void     *ud;           // Passed back to the callbacks
+  bool    (*progress)(void *ud, uint32_t it, double obj,
+                      double terr, double serr);
+  void    (*checkpoint)(void *ud, uint32_t it, const char *data, size_t len);
+  uint32_t  every;        // Iterations between checkpoints
+} api_trn_cb_t;
+
+/*
+ * Transport between the nodes of a distributed training, see dist.c.
+ * Every node calls the collectives in the same order, with the same
+ * sizes for allreduce:
+ *   - allreduce replaces x with its sum over all the nodes, which must
+ *     get bitwise identical results.
+ *   - allgather returns the concatenation of the blocks of every node,
+ *     in rank order, in a buffer released with free, and stores their
+ *     sizes in lens.
+ * api_new_dist_tcp makes one over a TCP ring, others can be plugged in
+ * by filling this in, over MPI_Allreduce and MPI_Allgatherv say.
+ */
+struct api_dist_s {
+  uint32_t  rank, size;   // Rank of this node, number of nodes
+  void     *ud;
+  void    (*allreduce)(api_dist_t *dist, double x[], uint64_t n);
+  void   *(*allgather)(api_dist_t *dist, const void *buf, size_t len,
+                       size_t lens[]);
+};
+
+char *api_label_seq(mdl_t *mdl, const char *strseq);
+void api_load_patterns(mdl_t *mdl, const char *lines);
+void api_add_train_seq(mdl_t *mdl, const char *lines);
+uint32_t api_add_train_stream(mdl_t *mdl, FILE *file);
 void api_train(mdl_t *mdl);
+void api_train_warm(mdl_t *mdl, uint32_t maxiter);
+api_trn_t *api_train_async(mdl_t *mdl, const api_trn_cb_t *cb);
+void api_train_cancel(api_trn_t *trn);
+bool api_train_done(api_trn_t *trn, uint32_t *iter);
+void api_train_wait(api_trn_t *trn);
 void api_save_model(mdl_t *mdl, FILE *file);
+void api_save_model_binary(mdl_t *mdl, FILE *file);
+double api_compact_model(mdl_t *mdl, uint32_t bits);
+void api_freeze_model(mdl_t *mdl);
 mdl_t *api_load_model(char *filename, opt_t *options);
-mdl_t *api_new_model(opt_t *options, char *patterns);
+mdl_t *api_new_model(opt_t *options, const char *patterns);
+void api_free_model(mdl_t *mdl);
+
+api_ctx_t *api_new_ctx(void);
+void api_free_ctx(api_ctx_t *ctx);
+const char *api_label_seq_ctx(mdl_t *mdl, api_ctx_t *ctx, const char *strseq);
+uint32_t api_label_ids(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                       uint32_t lbls[], uint32_t size);
+uint32_t api_label_strs(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                        const char *lbls[], uint32_t size);
+uint32_t api_label_cols(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                        uint32_t T, uint32_t C, uint32_t lbls[],
+                        uint32_t size);
+void api_add_train_cols(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                        uint32_t T, uint32_t C);
+uint32_t api_label_nbest(mdl_t *mdl, api_ctx_t *ctx, const char *buf,
+                         size_t len, uint32_t n, bool post);
+uint32_t api_ctx_length(const api_ctx_t *ctx);
+const uint32_t *api_nbest_labels(const api_ctx_t *ctx, uint32_t i,
+                                 double *score);
+const double *api_nbest_marginals(const api_ctx_t *ctx, uint32_t t);
+uint32_t api_label_count(mdl_t *mdl);
+const char *api_label_name(mdl_t *mdl, uint32_t id);
+uint64_t api_prune_weights(mdl_t *mdl, double thresh);
+uint64_t api_prune_bio(mdl_t *mdl);
+void api_prune_clear(mdl_t *mdl);
+void api_set_beam(mdl_t *mdl, uint32_t width);
+void api_set_cache(mdl_t *mdl, uint32_t size);
+void api_set_token_cache(mdl_t *mdl, uint32_t size);
+void api_cache_stats(mdl_t *mdl, uint64_t *hits, uint64_t *misses);
+void api_set_cutoff(mdl_t *mdl, uint32_t k);
+void api_set_hashing(mdl_t *mdl, uint32_t bits);
+void api_set_stats(mdl_t *mdl, bool on);
+void api_get_stats(mdl_t *mdl, api_stats_t *stats);
+void api_ctx_stats(const api_ctx_t *ctx, api_stats_t *stats);
+void api_set_active(mdl_t *mdl, uint32_t period);
+void api_set_dist(mdl_t *mdl, api_dist_t *dist);
+api_dist_t *api_new_dist_tcp(uint32_t rank, uint32_t size,
+                             const char *const nodes[]);
+void api_free_dist_tcp(api_dist_t *dist);
+api_evs_t *api_new_evalset(mdl_t *mdl);
+void api_free_evalset(api_evs_t *evs);
+void api_evalset_add(api_evs_t *evs, const char *lines);
+void api_evalset_add_cols(api_evs_t *evs, const api_span_t cells[],
+                          uint32_t T, uint32_t C);
+uint32_t api_evalset_count(const api_evs_t *evs);
+void api_eval(mdl_t *mdl, api_evs_t *evs, api_eval_t *res);
+double api_eval_label(const api_evs_t *evs, uint32_t lbl, double *prec,
+                      double *rec);
+const uint32_t *api_eval_labels(const api_evs_t *evs, uint32_t s,
+                                uint32_t *len);
+void api_label_batch(mdl_t *mdl, const char *seqs[], uint32_t n, char *results[]);
+
+api_reg_t *api_new_registry(bool share);
+void api_free_registry(api_reg_t *reg);
+void api_registry_add(api_reg_t *reg, const char *name, mdl_t *mdl);
+void api_registry_load(api_reg_t *reg, const char *name, char *filename,
+                       opt_t *options);
+bool api_registry_remove(api_reg_t *reg, const char *name);
+mdl_t *api_registry_acquire(api_reg_t *reg, const char *name);
+void api_registry_release(api_reg_t *reg, mdl_t *mdl);
+
+/*
+ * The 4 logging levels. FATAL and PFATAL are actually more like final
+ * words and and not logging. See wapiti src for more info.
+ */
+enum loglvl {
+  FATAL,
+  PFATAL,
+  WARNING,
+  INFO
+};
+
+extern void (* api_logs[4])(char *msg);
+void api_set_log_level(int level);
+void api_set_log_ring(uint32_t size);
+uint64_t api_log_dropped(void);
 
 void inf_log(char *msg);
 void wrn_log(char *msg);
 void err_log(char *msg);
 
+#endif
@@ -0,0 +1,60 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "wapiti.h"
+#include "tools.h"
+#include "arena.h"
+
+/* Allocations are aligned for any of the types we store */
+#define arn_align ((size_t)16)
+
+struct arn_chunk_s {
+  arn_chunk_t *next;
+  size_t       size, used;
+  char        *data;
+};
+
+/* Creates an empty arena taking memory in chunks of the given size */
+arn_t *arn_new(size_t chunk) {
+  arn_t *arn = xmalloc(sizeof(arn_t));
+  arn->chunk = chunk;
+  arn->head = NULL;
+  arn->total = 0;
+  return arn;
+}
+
+/*
+ * Returns size bytes from the current chunk, starting a new one when
+ * it is full. Requests larger than the chunk size get a chunk of their
+ * own.
+ */
+void *arn_alloc(arn_t *arn, size_t size) {
+  size = (size + arn_align - 1) & ~(arn_align - 1);
+  arn_chunk_t *chk = arn->head;
+  if (chk == NULL || chk->size - chk->used < size) {
+    const size_t csize = max(arn->chunk, size);
+    chk = xmalloc(sizeof(arn_chunk_t));
+    chk->data = xmalloc(csize);
+    chk->size = csize;
+    chk->used = 0;
+    chk->next = arn->head;
+    arn->head = chk;
+  }
+  void *ptr = chk->data + chk->used;
+  chk->used += size;
+  arn->total += size;
+  return ptr;
+}
+
+/* Releases the arena and everything allocated from it */
+void arn_free(arn_t *arn) {
+  arn_chunk_t *chk = arn->head;
+  while (chk != NULL) {
+    arn_chunk_t *next = chk->next;
+    free(chk->data);
+    free(chk);
+    chk = next;
+  }
+  free(arn);
+}
@@ -0,0 +1,24 @@
+#ifndef arena_h
+#define arena_h
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for data that lives and dies together. Memory is
+ * taken from large chunks in allocation order and only released all at
+ * once with arn_free.
+ */
+typedef struct arn_chunk_s arn_chunk_t;
+
+typedef struct arn_s arn_t;
+struct arn_s {
+  size_t       chunk;   // Default chunk size
+  arn_chunk_t *head;    // Current chunk, linked to the previous ones
+  size_t       total;   // Bytes handed out so far
+};
+
+arn_t *arn_new(size_t chunk);
+void *arn_alloc(arn_t *arn, size_t size);
+void arn_free(arn_t *arn);
+
+#endif
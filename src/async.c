@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "decoder.h"
+#include "progress.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Asynchronous training
+ *
+ * api_train_async runs the training of api_train on a thread of its
+ * own and returns at once. The Makefile wraps uit_progress, which every
+ * trainer calls after each iteration, so the wrapper below can hand
+ * the iteration results to the caller, write checkpoints and stop the
+ * trainer when asked, the same way wapiti stops it on SIGINT. The
+ * process signal handlers are left as they are.
+ *
+ * The model belongs to the training thread until api_train_wait
+ * returns, only the callbacks may read it in the meantime.
+ */
+struct api_trn_s {
+  mdl_t          *mdl;
+  api_trn_cb_t    cb;
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  bool            cancel;
+  bool            done;
+  uint32_t        iter;   // Last iteration completed
+  bool            evald;  // Whether te and se hold the current iteration
+  double          te, se;
+};
+
+bool __real_uit_progress(mdl_t *mdl, uint32_t it, double obj);
+void __real_tag_eval(mdl_t *mdl, double *te, double *se);
+
+/*
+ * wapiti's uit_progress already labels the development or training data
+ * to print its error rates. The Makefile wraps tag_eval so the progress
+ * callback gets them without labeling everything a second time.
+ */
+void __wrap_tag_eval(mdl_t *mdl, double *te, double *se) {
+  __real_tag_eval(mdl, te, se);
+  api_trn_t *trn = mdl_ext(mdl)->trn;
+  if (trn != NULL) {
+    trn->te = *te;
+    trn->se = *se;
+    trn->evald = true;
+  }
+}
+
+/*
+ * Saves the model in memory and hands the text to the checkpoint
+ * callback.
+ */
+static void asy_checkpoint(api_trn_t *trn, uint32_t it) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&buf, &len);
+  if (mem == NULL)
+    pfatal("cannot write checkpoint");
+  txt_save(trn->mdl, mem);
+  fclose(mem);
+  trn->cb.checkpoint(trn->cb.ud, it, buf, len);
+  free(buf);
+}
+
+/* Hands an iteration to the callbacks, returns false to stop training */
+static bool asy_report(api_trn_t *trn, uint32_t it, double obj) {
+  mdl_t *mdl = trn->mdl;
+  bool go = true;
+  if (trn->cb.progress != NULL) {
+    if (!trn->evald)
+      tag_eval(mdl, &trn->te, &trn->se);
+    if (!trn->cb.progress(trn->cb.ud, it, obj, trn->te, trn->se))
+      go = false;
+  }
+  trn->evald = false;
+  if (trn->cb.checkpoint != NULL && trn->cb.every != 0
+      && it % trn->cb.every == 0)
+    asy_checkpoint(trn, it);
+  pthread_mutex_lock(&trn->lock);
+  trn->iter = it;
+  if (trn->cancel)
+    go = false;
+  pthread_mutex_unlock(&trn->lock);
+  return go;
+}
+
+/*
+ * Reports the end of an iteration. Returns false to stop training, as
+ * wapiti's own version does when it converged or got a SIGINT. In
+ * distributed training, all the nodes stop together.
+ */
+bool __wrap_uit_progress(mdl_t *mdl, uint32_t it, double obj) {
+  api_trn_t *trn = mdl_ext(mdl)->trn;
+  bool go = __real_uit_progress(mdl, it, obj);
+  if (trn != NULL)
+    go = asy_report(trn, it, obj) && go;
+  return dst_agree(mdl, go);
+}
+
+static void *asy_run(void *ud) {
+  api_trn_t *trn = ud;
+  mdl_t *mdl = trn->mdl;
+  ext_trn_f *train = ext_trainer(mdl);
+
+  // uit_setup also prepares the convergence test, but its SIGINT
+  // handler is put back as it was
+  struct sigaction sig;
+  sigaction(SIGINT, NULL, &sig);
+  uit_setup(mdl);
+  sigaction(SIGINT, &sig, NULL);
+  train(mdl);
+  uit_cleanup(mdl);
+  sigaction(SIGINT, &sig, NULL);
+  ext_trained(mdl);
+  mdl_ext(mdl)->trn = NULL;
+
+  pthread_mutex_lock(&trn->lock);
+  trn->done = true;
+  pthread_mutex_unlock(&trn->lock);
+  return NULL;
+}
+
+/*
+ * Starts training the model on its training data in the background,
+ * like api_train, and returns a handle to follow it. cb may be NULL,
+ * its callbacks are run on the training thread:
+ *   - progress after each iteration, with the objective and the token
+ *     and sequence error rates on the development data or else on the
+ *     training data. Returning false stops training.
+ *   - checkpoint every that many iterations, with the model saved as
+ *     by api_save_model. The text is only valid during the call.
+ */
+api_trn_t *api_train_async(mdl_t *mdl, const api_trn_cb_t *cb) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->trn != NULL)
+    fatal("model is already training");
+  ext_trainer(mdl);
+  ext_thaw(mdl);
+  ext_sync(mdl);
+  ext_schedule(mdl);
+
+  api_trn_t *trn = xmalloc(sizeof(api_trn_t));
+  trn->mdl = mdl;
+  trn->cb.ud = NULL;
+  trn->cb.progress = NULL;
+  trn->cb.checkpoint = NULL;
+  trn->cb.every = 0;
+  if (cb != NULL)
+    trn->cb = *cb;
+  trn->cancel = false;
+  trn->done = false;
+  trn->iter = 0;
+  trn->evald = false;
+  pthread_mutex_init(&trn->lock, NULL);
+  ext->trn = trn;
+  if (pthread_create(&trn->thread, NULL, asy_run, trn) != 0)
+    fatal("cannot start training thread");
+  return trn;
+}
+
+/*
+ * Asks the training to stop, it ends with the current iteration and
+ * keeps the weights reached so far.
+ */
+void api_train_cancel(api_trn_t *trn) {
+  pthread_mutex_lock(&trn->lock);
+  trn->cancel = true;
+  pthread_mutex_unlock(&trn->lock);
+}
+
+/*
+ * Returns true once training is over, and stores the last completed
+ * iteration in iter if not NULL.
+ */
+bool api_train_done(api_trn_t *trn, uint32_t *iter) {
+  pthread_mutex_lock(&trn->lock);
+  const bool done = trn->done;
+  if (iter != NULL)
+    *iter = trn->iter;
+  pthread_mutex_unlock(&trn->lock);
+  return done;
+}
+
+/*
+ * Waits for the end of training and releases the handle. The model is
+ * then trained and can be used again.
+ */
+void api_train_wait(api_trn_t *trn) {
+  pthread_join(trn->thread, NULL);
+  pthread_mutex_destroy(&trn->lock);
+  free(trn);
+}
@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "quark.h"
+#include "reader.h"
+#include "tools.h"
+#include "vmath.h"
+#include "api.h"
+#include "dict.h"
+#include "mdlext.h"
+
+/*
+ * Binary model files
+ *
+ * The text format written by mdl_save needs every observation and
+ * weight to be parsed and the quarks rebuilt on load. Binary files
+ * instead store everything in the layout used in memory, so they can
+ * be mapped and used in place: loading is near instant and the pages
+ * are shared by all processes using the same model.
+ *
+ * A file is a header followed by 8-byte aligned sections:
+ *   - patterns, labels and observations as dictionaries (see dict.h):
+ *     a count, cnt+1 string offsets, cnt sorted ids and the strings.
+ *     Hashed models store their tag as the only observation, see
+ *     features.c;
+ *   - the kind, uoff and boff arrays of the observations;
+ *   - the feature weights as doubles.
+ * All numbers are in native byte order, and files are refused on hosts
+ * with another order.
+ */
+
+static const char bin_magic[8] = "WPTBIN\n";
+static const uint32_t bin_version = 1;
+static const uint32_t bin_endian  = 0x01020304;
+
+typedef struct bin_hdr_s bin_hdr_t;
+struct bin_hdr_s {
+  char     magic[8];
+  uint32_t version;
+  uint32_t endian;
+  int32_t  type;
+  uint32_t nlbl;
+  uint32_t npats;
+  uint32_t ntoks;
+  uint64_t nobs;
+  uint64_t nftr;
+  // Offsets of the sections from the start of the file
+  uint64_t pats, lbls, obs;
+  uint64_t kind, uoff, boff, theta;
+  uint64_t size;
+};
+
+/* Rounds a size up to the section alignment */
+static uint64_t bin_align(uint64_t size) {
+  return (size + 7) & ~(uint64_t)7;
+}
+
+/* Writes exactly size bytes or dies */
+static void bin_write(FILE *file, const void *data, size_t size) {
+  if (size != 0 && fwrite(data, size, 1, file) != 1)
+    pfatal("cannot write to binary model file");
+}
+
+/* Pads the output up to the next section boundary */
+static void bin_pad(FILE *file, uint64_t size) {
+  static const char zeros[8] = {0};
+  bin_write(file, zeros, bin_align(size) - size);
+}
+
+typedef struct bin_str_s {
+  const char *str;
+  uint64_t    id;
+} bin_str_t;
+
+static int bin_strcmp(const void *a, const void *b) {
+  return strcmp(((const bin_str_t *)a)->str, ((const bin_str_t *)b)->str);
+}
+
+/* Returns the blob size of a list of strings */
+static uint64_t bin_blobsz(const char **strs, uint64_t cnt) {
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < cnt; i++)
+    size += strlen(strs[i]) + 1;
+  return size;
+}
+
+/* Returns the size of a dictionary section, padding included */
+static uint64_t bin_dctsz(const char **strs, uint64_t cnt) {
+  return sizeof(uint64_t) * (2 * cnt + 2) + bin_align(bin_blobsz(strs, cnt));
+}
+
+/* Writes a list of strings, in id order, as a dictionary section */
+static void bin_wrtdct(FILE *file, const char **strs, uint64_t cnt) {
+  bin_write(file, &cnt, sizeof(uint64_t));
+  uint64_t off = 0;
+  for (uint64_t i = 0; i < cnt; i++) {
+    bin_write(file, &off, sizeof(uint64_t));
+    off += strlen(strs[i]) + 1;
+  }
+  bin_write(file, &off, sizeof(uint64_t));
+
+  bin_str_t *srt = xmalloc(sizeof(bin_str_t) * (cnt + 1));
+  for (uint64_t i = 0; i < cnt; i++) {
+    srt[i].str = strs[i];
+    srt[i].id  = i;
+  }
+  qsort(srt, cnt, sizeof(bin_str_t), bin_strcmp);
+  for (uint64_t i = 0; i < cnt; i++)
+    bin_write(file, &srt[i].id, sizeof(uint64_t));
+  free(srt);
+
+  for (uint64_t i = 0; i < cnt; i++)
+    bin_write(file, strs[i], strlen(strs[i]) + 1);
+  bin_pad(file, off);
+}
+
+/*
+ * Saves the model in the binary format. The output doesn't need to be
+ * seekable, all section offsets are computed upfront.
+ */
+void api_save_model_binary(mdl_t *mdl, FILE *file) {
+  const rdr_t *rdr = mdl->reader;
+  const uint32_t P = rdr->npats;
+  const uint32_t Y = mdl->nlbl;
+  const uint64_t O = mdl->nobs;
+  const uint64_t F = mdl->nftr;
+
+  // Hashed models only save their tag in place of the observations
+  const uint64_t N = mdl_ext(mdl)->hbits != 0 ? 1 : O;
+  const char **pats = xmalloc(sizeof(char *) * (P + 1));
+  const char **lbls = xmalloc(sizeof(char *) * (Y + 1));
+  const char **obs  = xmalloc(sizeof(char *) * (N + 1));
+  char tag[fsp_tagsz];
+  for (uint32_t p = 0; p < P; p++)
+    pats[p] = rdr->pats[p]->src;
+  for (uint32_t y = 0; y < Y; y++)
+    lbls[y] = qrk_id2str(rdr->lbl, y);
+  if (N != O) {
+    fsp_tag(mdl, tag);
+    obs[0] = tag;
+  } else {
+    for (uint64_t o = 0; o < O; o++)
+      obs[o] = ext_id2obs(mdl, o);
+  }
+
+  bin_hdr_t hdr;
+  memset(&hdr, 0, sizeof(bin_hdr_t));
+  memcpy(hdr.magic, bin_magic, sizeof(hdr.magic));
+  hdr.version = bin_version;
+  hdr.endian  = bin_endian;
+  hdr.type    = mdl->type;
+  hdr.nlbl    = Y;
+  hdr.npats   = P;
+  hdr.ntoks   = rdr->ntoks;
+  hdr.nobs    = O;
+  hdr.nftr    = F;
+  hdr.pats    = bin_align(sizeof(bin_hdr_t));
+  hdr.lbls    = hdr.pats + bin_dctsz(pats, P);
+  hdr.obs     = hdr.lbls + bin_dctsz(lbls, Y);
+  hdr.kind    = hdr.obs  + bin_dctsz(obs, N);
+  hdr.uoff    = hdr.kind + bin_align(O);
+  hdr.boff    = hdr.uoff + sizeof(uint64_t) * O;
+  hdr.theta   = hdr.boff + sizeof(uint64_t) * O;
+  hdr.size    = hdr.theta + sizeof(double) * F;
+
+  bin_write(file, &hdr, sizeof(bin_hdr_t));
+  bin_pad(file, sizeof(bin_hdr_t));
+  bin_wrtdct(file, pats, P);
+  bin_wrtdct(file, lbls, Y);
+  bin_wrtdct(file, obs, N);
+  bin_write(file, mdl->kind, O);
+  bin_pad(file, O);
+  bin_write(file, mdl->uoff, sizeof(uint64_t) * O);
+  bin_write(file, mdl->boff, sizeof(uint64_t) * O);
+  if (mdl_ext(mdl)->wbits != 0) {
+    double *theta = cmp_weights(mdl);
+    bin_write(file, theta, sizeof(double) * F);
+    xvm_free(theta);
+  } else {
+    bin_write(file, mdl->theta, sizeof(double) * F);
+  }
+
+  free(obs);
+  free(lbls);
+  free(pats);
+}
+
+/*
+ * Returns true if the file starts like a binary model. The file is
+ * rewound in any case.
+ */
+bool bin_check(FILE *file) {
+  char magic[sizeof(bin_magic)];
+  const size_t n = fread(magic, 1, sizeof(magic), file);
+  rewind(file);
+  return n == sizeof(magic) && !memcmp(magic, bin_magic, sizeof(magic));
+}
+
+/*
+ * Maps a dictionary section at off in the mapping, checking it doesn't
+ * go past end. Every string must start inside the blob, which must end
+ * with a NUL, and the sorted index must only hold valid ids, so lookups
+ * never leave the section. Returns false on a malformed section.
+ */
+static bool bin_mapdct(dct_t *dct, const char *base, uint64_t off,
+                      uint64_t end) {
+  if ((off & 7) != 0 || off > end || end - off < sizeof(uint64_t))
+    return false;
+  const uint64_t cnt = *(const uint64_t *)(base + off);
+  if (cnt > (end - off) / sizeof(uint64_t) / 2)
+    return false;
+  const uint64_t blob = off + sizeof(uint64_t) * (2 * cnt + 2);
+  if (blob > end)
+    return false;
+  dct->cnt    = cnt;
+  dct->offs   = (const uint64_t *)(base + off) + 1;
+  dct->sorted = dct->offs + cnt + 1;
+  dct->blob   = base + blob;
+  const uint64_t len = dct->offs[cnt];
+  if (len > end - blob)
+    return false;
+  if (cnt != 0 && (len == 0 || dct->blob[len - 1] != '\0'))
+    return false;
+  for (uint64_t i = 0; i < cnt; i++)
+    if (dct->offs[i] >= len || dct->sorted[i] >= cnt)
+      return false;
+  return true;
+}
+
+/*
+ * Checks that every observation has a known kind and that its weight
+ * blocks lie inside the weights section, so scoring never reads past
+ * the mapping.
+ */
+static bool bin_chkobs(const bin_hdr_t *hdr, const char *base) {
+  const char *kind = base + hdr->kind;
+  const uint64_t *uoff = (const uint64_t *)(base + hdr->uoff);
+  const uint64_t *boff = (const uint64_t *)(base + hdr->boff);
+  const uint64_t Y = hdr->nlbl, F = hdr->nftr;
+  for (uint64_t o = 0; o < hdr->nobs; o++) {
+    if ((kind[o] & ~3) != 0)
+      return false;
+    if ((kind[o] & 1) && (uoff[o] > F || F - uoff[o] < Y))
+      return false;
+    if ((kind[o] & 2) && (boff[o] > F || F - boff[o] < Y * Y))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Loads a binary model by mapping the file read-only. The patterns and
+ * the labels are small and go to the reader as usual, the observations
+ * and the weights are used in place from the mapping.
+ *
+ * The mapping is shared with the file, so a model file in use must
+ * never be rewritten in place, including to reload it with
+ * api_registry_load: threads still labeling with the old model would
+ * get a SIGBUS. Write the new file aside and rename it over the old.
+ */
+void bin_load(mdl_t *mdl, const char *filename) {
+  const char *err = "invalid binary model file";
+  mdl_ext_t *ext = mdl_ext(mdl);
+  rdr_t *rdr = mdl->reader;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    pfatal("cannot open input model file: %s", filename);
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    pfatal("cannot stat model file: %s", filename);
+  const size_t size = st.st_size;
+  if (size < sizeof(bin_hdr_t))
+    fatal(err);
+  char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    pfatal("cannot map model file: %s", filename);
+  close(fd);
+  ext->map = base;
+  ext->mapsz = size;
+
+  // Check the header and that every section lies inside the file
+  const bin_hdr_t *hdr = (const bin_hdr_t *)base;
+  if (memcmp(hdr->magic, bin_magic, sizeof(hdr->magic)))
+    fatal(err);
+  if (hdr->endian != bin_endian)
+    fatal("binary model file has another byte order");
+  if (hdr->version != bin_version)
+    fatal("unsupported binary model version %"PRIu32, hdr->version);
+  if (hdr->size != size || hdr->kind > hdr->uoff || hdr->uoff > hdr->boff
+      || hdr->boff > hdr->theta || hdr->theta > hdr->size
+      || hdr->uoff - hdr->kind < hdr->nobs
+      || hdr->boff - hdr->uoff != sizeof(uint64_t) * hdr->nobs
+      || hdr->theta - hdr->boff != sizeof(uint64_t) * hdr->nobs
+      || hdr->size - hdr->theta != sizeof(double) * hdr->nftr
+      || ((hdr->uoff | hdr->boff | hdr->theta) & 7) != 0)
+    fatal(err);
+  dct_t pats, lbls;
+  if (!bin_mapdct(&pats, base, hdr->pats, hdr->lbls)
+      || !bin_mapdct(&lbls, base, hdr->lbls, hdr->obs)
+      || !bin_mapdct(&ext->obs, base, hdr->obs, hdr->kind)
+      || pats.cnt != hdr->npats || lbls.cnt != hdr->nlbl)
+    fatal(err);
+
+  // Compile the patterns and fill the labels quark
+  for (uint32_t p = 0; p < hdr->npats; p++) {
+    const char *src = dct_id2str(&pats, p);
+    char *patstr = xmalloc(strlen(src) + 1);
+    strcpy(patstr, src);
+    api_addpat(rdr, patstr);
+  }
+  rdr->ntoks = max(rdr->ntoks, hdr->ntoks);
+  if (ext->obs.cnt == 1 && hdr->nobs != 1
+      && fsp_load(mdl, dct_id2str(&ext->obs, 0))) {
+    if (fsp_count(mdl) != hdr->nobs)
+      fatal(err);
+  } else if (ext->obs.cnt != hdr->nobs) {
+    fatal(err);
+  }
+  if (!bin_chkobs(hdr, base))
+    fatal(err);
+  for (uint32_t y = 0; y < hdr->nlbl; y++)
+    qrk_str2id(rdr->lbl, dct_id2str(&lbls, y));
+  qrk_lock(rdr->lbl, true);
+  qrk_lock(rdr->obs, true);
+
+  // And point the model at the mapped arrays
+  mdl->type  = hdr->type;
+  mdl->nlbl  = hdr->nlbl;
+  mdl->nobs  = hdr->nobs;
+  mdl->nftr  = hdr->nftr;
+  mdl->kind  = base + hdr->kind;
+  mdl->uoff  = (uint64_t *)(base + hdr->uoff);
+  mdl->boff  = (uint64_t *)(base + hdr->boff);
+  mdl->theta = (double *)(base + hdr->theta);
+}
+
+/*
+ * Turns a mapped model into a regular one, with its own copy of the
+ * weights and a filled observation quark, as needed by everything in
+ * wapiti that writes to the model (training, text saving). Does nothing
+ * for regular models.
+ */
+void bin_thaw(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->map == NULL)
+    return;
+  const uint64_t O = mdl->nobs, F = mdl->nftr;
+
+  qrk_t *obs = mdl->reader->obs;
+  qrk_lock(obs, false);
+  for (uint64_t o = 0; ext->hbits == 0 && o < O; o++)
+    qrk_str2id(obs, dct_id2str(&ext->obs, o));
+  qrk_lock(obs, true);
+
+  char     *kind = xmalloc(sizeof(char) * O + 1);
+  uint64_t *uoff = xmalloc(sizeof(uint64_t) * O + 1);
+  uint64_t *boff = xmalloc(sizeof(uint64_t) * O + 1);
+  double   *theta = xvm_new(F);
+  memcpy(kind, mdl->kind, sizeof(char) * O);
+  memcpy(uoff, mdl->uoff, sizeof(uint64_t) * O);
+  memcpy(boff, mdl->boff, sizeof(uint64_t) * O);
+  memcpy(theta, mdl->theta, sizeof(double) * F);
+
+  bin_unmap(mdl);
+  mdl->kind  = kind;
+  mdl->uoff  = uoff;
+  mdl->boff  = boff;
+  mdl->theta = theta;
+}
+
+/*
+ * Releases the mapping of a binary model, leaving the model without
+ * weights. Used before freeing it, as mdl_free would otherwise try to
+ * free the mapped arrays.
+ */
+void bin_unmap(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->map == NULL)
+    return;
+  munmap(ext->map, ext->mapsz);
+  ext->map = NULL;
+  ext->mapsz = 0;
+  memset(&ext->obs, 0, sizeof(dct_t));
+  mdl->kind  = NULL;
+  mdl->uoff  = NULL;
+  mdl->boff  = NULL;
+  mdl->theta = NULL;
+}
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Label results cache
+ *
+ * Models can keep the labels of the last sequences they decoded, so an
+ * exact repeat skips feature extraction and decoding. The key is the
+ * list of non-empty input lines, so blank lines around or between them
+ * don't matter, and the value the label of each line.
+ *
+ * The cache is a hash table of entries also linked in LRU order, most
+ * recently used first, under a single lock. It is cleared whenever the
+ * model weights or the decoding setup change through the API.
+ */
+typedef struct lbc_ent_s lbc_ent_t;
+struct lbc_ent_s {
+  lbc_ent_t *hnext;       // Next entry in the same bucket
+  lbc_ent_t *prev, *next; // LRU list
+  uint64_t   hash;
+  uint32_t   keylen;
+  uint32_t   len;
+  uint32_t  *lbls;        // [len]  stored after the key
+  char       key[];
+};
+
+struct lbc_s {
+  pthread_mutex_t lock;
+  uint32_t        size, cnt;
+  uint64_t        mask;
+  lbc_ent_t     **tbl;
+  lbc_ent_t      *head, *tail;
+  uint64_t        hits, misses;
+};
+
+/* FNV-1a with a final mix, over len bytes */
+static uint64_t lbc_hash(const char *str, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Releases all the entries */
+static void lbc_flush(lbc_t *lbc) {
+  lbc_ent_t *ent = lbc->head;
+  while (ent != NULL) {
+    lbc_ent_t *next = ent->next;
+    free(ent);
+    ent = next;
+  }
+  memset(lbc->tbl, 0, sizeof(lbc_ent_t *) * (lbc->mask + 1));
+  lbc->head = lbc->tail = NULL;
+  lbc->cnt = 0;
+}
+
+/*
+ * Sets the number of sequences the model keeps the labels of. 0 drops
+ * the cache, any other size starts with an empty one.
+ */
+void api_set_cache(mdl_t *mdl, uint32_t size) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  lbc_free(mdl);
+  if (size == 0)
+    return;
+  lbc_t *lbc = xmalloc(sizeof(lbc_t));
+  pthread_mutex_init(&lbc->lock, NULL);
+  lbc->size = size;
+  lbc->cnt = 0;
+  lbc->mask = 15;
+  while (lbc->mask + 1 < (uint64_t)size * 2)
+    lbc->mask = lbc->mask * 2 + 1;
+  lbc->tbl = xmalloc(sizeof(lbc_ent_t *) * (lbc->mask + 1));
+  memset(lbc->tbl, 0, sizeof(lbc_ent_t *) * (lbc->mask + 1));
+  lbc->head = lbc->tail = NULL;
+  lbc->hits = lbc->misses = 0;
+  ext->lbc = lbc;
+}
+
+/*
+ * Stores the number of labelings answered from the cache, and of the
+ * ones that had to be decoded, since it was set.
+ */
+void api_cache_stats(mdl_t *mdl, uint64_t *hits, uint64_t *misses) {
+  lbc_t *lbc = mdl_ext(mdl)->lbc;
+  *hits = *misses = 0;
+  if (lbc == NULL)
+    return;
+  pthread_mutex_lock(&lbc->lock);
+  *hits = lbc->hits;
+  *misses = lbc->misses;
+  pthread_mutex_unlock(&lbc->lock);
+}
+
+/* Drops the cache */
+void lbc_free(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  lbc_t *lbc = ext->lbc;
+  if (lbc == NULL)
+    return;
+  lbc_flush(lbc);
+  pthread_mutex_destroy(&lbc->lock);
+  free(lbc->tbl);
+  free(lbc);
+  ext->lbc = NULL;
+}
+
+/* Empties the cache, after the model changed */
+void lbc_clear(mdl_t *mdl) {
+  lbc_t *lbc = mdl_ext(mdl)->lbc;
+  if (lbc == NULL)
+    return;
+  pthread_mutex_lock(&lbc->lock);
+  lbc_flush(lbc);
+  pthread_mutex_unlock(&lbc->lock);
+}
+
+/* Builds the key of the split input of the context in ctx->key */
+static void lbc_key(api_ctx_t *ctx) {
+  size_t pos = 0;
+  ctx->key = ctx_grow(ctx->key, &ctx->keysz, 1, 1);
+  for (uint32_t t = 0; t < ctx->len; t++) {
+    const api_span_t line = ctx->lines[t];
+    ctx->key = ctx_grow(ctx->key, &ctx->keysz, pos + line.len + 1, 1);
+    memcpy(ctx->key + pos, line.str, line.len);
+    pos += line.len;
+    ctx->key[pos++] = '\n';
+  }
+  ctx->keylen = pos;
+  ctx->keyhash = lbc_hash(ctx->key, pos);
+}
+
+/* Unlinks an entry from the LRU list */
+static void lbc_unlink(lbc_t *lbc, lbc_ent_t *ent) {
+  if (ent->prev != NULL)
+    ent->prev->next = ent->next;
+  else
+    lbc->head = ent->next;
+  if (ent->next != NULL)
+    ent->next->prev = ent->prev;
+  else
+    lbc->tail = ent->prev;
+}
+
+/* Links an entry at the front of the LRU list */
+static void lbc_front(lbc_t *lbc, lbc_ent_t *ent) {
+  ent->prev = NULL;
+  ent->next = lbc->head;
+  if (lbc->head != NULL)
+    lbc->head->prev = ent;
+  lbc->head = ent;
+  if (lbc->tail == NULL)
+    lbc->tail = ent;
+}
+
+/* Returns the address of the pointer to the entry of the context key */
+static lbc_ent_t **lbc_find(lbc_t *lbc, const api_ctx_t *ctx) {
+  lbc_ent_t **ref = &lbc->tbl[ctx->keyhash & lbc->mask];
+  while (*ref != NULL) {
+    const lbc_ent_t *ent = *ref;
+    if (ent->hash == ctx->keyhash && ent->keylen == ctx->keylen
+        && !memcmp(ent->key, ctx->key, ctx->keylen))
+      break;
+    ref = &(*ref)->hnext;
+  }
+  return ref;
+}
+
+/*
+ * Looks up the split input of the context, and on a hit copies the
+ * cached labels in ctx->out. Returns true on hits.
+ */
+bool lbc_get(mdl_t *mdl, api_ctx_t *ctx) {
+  lbc_t *lbc = mdl_ext(mdl)->lbc;
+  if (lbc == NULL)
+    return false;
+  lbc_key(ctx);
+  pthread_mutex_lock(&lbc->lock);
+  lbc_ent_t *ent = *lbc_find(lbc, ctx);
+  if (ent == NULL) {
+    lbc->misses++;
+    pthread_mutex_unlock(&lbc->lock);
+    return false;
+  }
+  lbc->hits++;
+  lbc_unlink(lbc, ent);
+  lbc_front(lbc, ent);
+  size_t outsz = ctx->outsz;
+  ctx->out = ctx_grow(ctx->out, &outsz, max(ent->len, 1u), sizeof(uint32_t));
+  memcpy(ctx->out, ent->lbls, sizeof(uint32_t) * ent->len);
+  pthread_mutex_unlock(&lbc->lock);
+  return true;
+}
+
+/*
+ * Stores the labels just decoded for the context input, evicting the
+ * least recently used entry if the cache is full. Must follow a missed
+ * lbc_get on the same input.
+ */
+void lbc_put(mdl_t *mdl, api_ctx_t *ctx) {
+  lbc_t *lbc = mdl_ext(mdl)->lbc;
+  if (lbc == NULL)
+    return;
+  const uint32_t T = ctx->len;
+  const size_t keysz = (ctx->keylen + 3) / 4 * 4;
+  lbc_ent_t *ent = xmalloc(sizeof(lbc_ent_t) + keysz
+                           + sizeof(uint32_t) * T);
+  ent->hash = ctx->keyhash;
+  ent->keylen = ctx->keylen;
+  ent->len = T;
+  ent->lbls = (uint32_t *)(ent->key + keysz);
+  memcpy(ent->key, ctx->key, ctx->keylen);
+  memcpy(ent->lbls, ctx->out, sizeof(uint32_t) * T);
+
+  pthread_mutex_lock(&lbc->lock);
+  lbc_ent_t **ref = lbc_find(lbc, ctx);
+  if (*ref != NULL) {
+    // Another thread stored it in the meantime
+    pthread_mutex_unlock(&lbc->lock);
+    free(ent);
+    return;
+  }
+  ent->hnext = NULL;
+  *ref = ent;
+  lbc_front(lbc, ent);
+  if (++lbc->cnt > lbc->size) {
+    lbc_ent_t *old = lbc->tail;
+    lbc_unlink(lbc, old);
+    lbc_ent_t **pos = &lbc->tbl[old->hash & lbc->mask];
+    while (*pos != old)
+      pos = &(*pos)->hnext;
+    *pos = old->hnext;
+    free(old);
+    lbc->cnt--;
+  }
+  pthread_mutex_unlock(&lbc->lock);
+}
@@ -0,0 +1,214 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "reader.h"
+#include "tools.h"
+#include "vmath.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Compact inference weights
+ *
+ * After training, most of the model memory is the double weights, and
+ * reading them is most of the memory traffic when decoding. A compact
+ * model first drops the observations whose weights are all zero, as
+ * mdl_compact does, then replaces the doubles either with floats, or
+ * with 16 or 8 bit integers scaled per block. A block is the set of
+ * unigram or bigram weights of one observation, so each scale only has
+ * to cover weights that are summed together.
+ *
+ * Decoding works directly on the compact weights. Anything that needs
+ * doubles again, like training or saving, expands them first, and the
+ * model stays expanded afterwards.
+ */
+
+/* Returns the offset and size of a weights block */
+static uint64_t cmp_block(const mdl_t *mdl, uint64_t o, bool bi,
+                          uint64_t *n) {
+  const uint64_t Y = mdl->nlbl;
+  *n = bi ? Y * Y : Y;
+  return bi ? mdl->boff[o] : mdl->uoff[o];
+}
+
+/*
+ * Quantizes the weights of every block to 8 or 16 bit integers, with
+ * the block largest weight mapped to the largest integer. Returns the
+ * largest error on a single weight.
+ */
+static double cmp_quantize(mdl_t *mdl, uint32_t bits) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  const double qmax = bits == 16 ? 32767.0 : 127.0;
+  const double *x = mdl->theta;
+  double err = 0.0;
+
+  ext->wscale = xmalloc(sizeof(float) * (2 * mdl->nobs + 1));
+  ext->qw = xmalloc(bits / 8 * mdl->nftr + 1);
+  for (uint64_t o = 0; o < mdl->nobs; o++) {
+    for (int bi = 0; bi < 2; bi++) {
+      ext->wscale[2 * o + bi] = 0.0f;
+      if (!(mdl->kind[o] & (1 << bi)))
+        continue;
+      uint64_t n, off = cmp_block(mdl, o, bi, &n);
+      double mx = 0.0;
+      for (uint64_t i = 0; i < n; i++)
+        mx = max(mx, fabs(x[off + i]));
+      const float scale = mx / qmax;
+      ext->wscale[2 * o + bi] = scale;
+      for (uint64_t i = 0; i < n; i++) {
+        double q = scale != 0.0f ? rint(x[off + i] / scale) : 0.0;
+        q = max(min(q, qmax), -qmax);
+        if (bits == 16)
+          ((int16_t *)ext->qw)[off + i] = q;
+        else
+          ((int8_t *)ext->qw)[off + i] = q;
+        err = max(err, fabs(x[off + i] - q * scale));
+      }
+    }
+  }
+  return err;
+}
+
+/*
+ * Converts the model to compact weights of the given size: 64 only
+ * drops unused observations, 32 keeps floats and 16 or 8 scaled
+ * integers. Training data is released as its observation ids are no
+ * longer valid.
+ *
+ * Returns the largest absolute error made on a single weight. The
+ * score of a label at a position sums one weight per active feature,
+ * so it is off by at most this times the number of features there.
+ */
+double api_compact_model(mdl_t *mdl, uint32_t bits) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (bits != 64 && bits != 32 && bits != 16 && bits != 8)
+    fatal("unsupported weights size %"PRIu32, bits);
+
+  ext_thaw(mdl);
+  lbc_clear(mdl);
+  // The buckets of hashed models stay where the hash puts them
+  if (ext->hbits == 0)
+    mdl_compact(mdl);
+  ext_cleartrain(mdl);
+
+  ext->werr = 0.0;
+  if (bits == 64)
+    return 0.0;
+
+  if (bits == 32) {
+    ext->fw = xmalloc(sizeof(float) * mdl->nftr + 1);
+    for (uint64_t f = 0; f < mdl->nftr; f++) {
+      ext->fw[f] = mdl->theta[f];
+      ext->werr = max(ext->werr, fabs(mdl->theta[f] - ext->fw[f]));
+    }
+  } else {
+    ext->werr = cmp_quantize(mdl, bits);
+  }
+  ext->wbits = bits;
+  xvm_free(mdl->theta);
+  mdl->theta = NULL;
+  return ext->werr;
+}
+
+/*
+ * Adds the weights of the unigram, or bigram if bi is set, block of
+ * observation o to r, whatever the weights format.
+ */
+void cmp_addblk(mdl_t *mdl, uint64_t o, bool bi, double r[]) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  uint64_t n, off = cmp_block(mdl, o, bi, &n);
+  if (ext->wbits == 0) {
+    const double *x = mdl->theta + off;
+    for (uint64_t i = 0; i < n; i++)
+      r[i] += x[i];
+  } else if (ext->wbits == 32) {
+    const float *x = ext->fw + off;
+    for (uint64_t i = 0; i < n; i++)
+      r[i] += x[i];
+  } else if (ext->wbits == 16) {
+    const double scale = ext->wscale[2 * o + bi];
+    const int16_t *x = (const int16_t *)ext->qw + off;
+    for (uint64_t i = 0; i < n; i++)
+      r[i] += scale * x[i];
+  } else {
+    const double scale = ext->wscale[2 * o + bi];
+    const int8_t *x = (const int8_t *)ext->qw + off;
+    for (uint64_t i = 0; i < n; i++)
+      r[i] += scale * x[i];
+  }
+}
+
+/*
+ * Adds some of the bigram weights of observation o to r: r[k] gets the
+ * weight idx[k] of the block, whatever the weights format.
+ */
+void cmp_addidx(mdl_t *mdl, uint64_t o, const uint32_t idx[], uint64_t n,
+                double r[]) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  const uint64_t off = mdl->boff[o];
+  if (ext->wbits == 0) {
+    const double *x = mdl->theta + off;
+    for (uint64_t k = 0; k < n; k++)
+      r[k] += x[idx[k]];
+  } else if (ext->wbits == 32) {
+    const float *x = ext->fw + off;
+    for (uint64_t k = 0; k < n; k++)
+      r[k] += x[idx[k]];
+  } else if (ext->wbits == 16) {
+    const double scale = ext->wscale[2 * o + 1];
+    const int16_t *x = (const int16_t *)ext->qw + off;
+    for (uint64_t k = 0; k < n; k++)
+      r[k] += scale * x[idx[k]];
+  } else {
+    const double scale = ext->wscale[2 * o + 1];
+    const int8_t *x = (const int8_t *)ext->qw + off;
+    for (uint64_t k = 0; k < n; k++)
+      r[k] += scale * x[idx[k]];
+  }
+}
+
+/* Returns a new vector with the compact weights as doubles */
+double *cmp_weights(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  double *theta = xvm_new(mdl->nftr);
+  if (ext->wbits == 32) {
+    for (uint64_t f = 0; f < mdl->nftr; f++)
+      theta[f] = ext->fw[f];
+    return theta;
+  }
+  for (uint64_t f = 0; f < mdl->nftr; f++)
+    theta[f] = 0.0;
+  for (uint64_t o = 0; o < mdl->nobs; o++)
+    for (int bi = 0; bi < 2; bi++)
+      if (mdl->kind[o] & (1 << bi)) {
+        uint64_t n, off = cmp_block(mdl, o, bi, &n);
+        cmp_addblk(mdl, o, bi, theta + off);
+      }
+  return theta;
+}
+
+/* Goes back to double weights. Does nothing for regular models. */
+void cmp_expand(mdl_t *mdl) {
+  if (mdl_ext(mdl)->wbits == 0)
+    return;
+  mdl->theta = cmp_weights(mdl);
+  cmp_free(mdl);
+}
+
+/* Releases the compact weights */
+void cmp_free(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  free(ext->fw);
+  free(ext->qw);
+  free(ext->wscale);
+  ext->fw = NULL;
+  ext->qw = NULL;
+  ext->wscale = NULL;
+  ext->wbits = 0;
+}
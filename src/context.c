@@ -0,0 +1,880 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "pattern.h"
+#include "quark.h"
+#include "reader.h"
+#include "sequence.h"
+#include "tools.h"
+#include "vmath.h"
+#include "simd.h"
+#include "program.h"
+#include "context.h"
+#include "mdlext.h"
+
+/* Returned by qrk_str2id for strings missing from a locked quark */
+static const uint64_t qrk_none = (uint64_t)-1;
+
+/* Grows a scratch array to hold at least cnt items. Never shrinks. */
+void *ctx_grow(void *ptr, size_t *size, size_t cnt, size_t elem) {
+  if (cnt <= *size)
+    return ptr;
+  size_t nsize = *size * 2;
+  if (nsize < cnt)
+    nsize = cnt;
+  ptr = xrealloc(ptr, nsize * elem);
+  *size = nsize;
+  return ptr;
+}
+
+/* Returns the sum of the first N items of x */
+static double ctx_total(const double x[], uint32_t N) {
+  double tot = 0.0;
+  for (uint32_t n = 0; n < N; n++)
+    tot += x[n];
+  return tot;
+}
+
+/* Makes room for T positions in all the per-position arrays */
+static void ctx_reserve(api_ctx_t *ctx, uint32_t T) {
+  if (T <= ctx->size)
+    return;
+  uint32_t size = max(ctx->size * 2, T);
+  ctx->lines = xrealloc(ctx->lines, sizeof(api_span_t) * size);
+  ctx->lbls  = xrealloc(ctx->lbls,  sizeof(api_span_t) * size);
+  ctx->cnts  = xrealloc(ctx->cnts,  sizeof(uint32_t) * size);
+  ctx->first = xrealloc(ctx->first, sizeof(uint32_t) * size);
+  ctx->seq   = xrealloc(ctx->seq, sizeof(seq_t) + sizeof(pos_t) * size);
+  ctx->size  = size;
+}
+
+/* Creates an empty context, buffers are allocated on first use */
+api_ctx_t *api_new_ctx(void) {
+  api_ctx_t *ctx = xmalloc(sizeof(api_ctx_t));
+  memset(ctx, 0, sizeof(api_ctx_t));
+
+  ctx->atom = xmalloc(sizeof(pat_t) + sizeof(pat_item_t));
+  ctx->atom->src = NULL;
+  ctx->atom->ntoks = 1;
+  ctx->atom->nitems = 1;
+
+  ctx->tok = xmalloc(sizeof(tok_t) + sizeof(char **));
+  ctx->tok->len = 1;
+  ctx->tok->lbl = NULL;
+  ctx->tok->cnts = ctx->tokcnt;
+  ctx->tok->toks[0] = ctx->tokcell;
+  ctx->tokcnt[0] = 1;
+  return ctx;
+}
+
+/* Frees the context and all its buffers */
+void api_free_ctx(api_ctx_t *ctx) {
+  free(ctx->lines);
+  free(ctx->lbls);
+  free(ctx->cnts);
+  free(ctx->first);
+  free(ctx->cells);
+  free(ctx->seq);
+  free(ctx->obs);
+  free(ctx->buf);
+  free(ctx->cell);
+  free(ctx->atom);
+  free(ctx->tok);
+  free(ctx->voff);
+  free(ctx->vlen);
+  free(ctx->vbuf);
+  free(ctx->mark);
+  free(ctx->foff);
+  free(ctx->fbuf);
+  free(ctx->psi);
+  free(ctx->back);
+  free(ctx->cur);
+  free(ctx->old);
+  free(ctx->sum);
+  free(ctx->alpha);
+  free(ctx->beta);
+  free(ctx->nsc);
+  free(ctx->nbk);
+  free(ctx->npath);
+  free(ctx->eidx);
+  free(ctx->esrc);
+  free(ctx->eacc);
+  free(ctx->out);
+  free(ctx->psc);
+  free(ctx->tkey);
+  free(ctx->tids);
+  free(ctx->tkind);
+  free(ctx->key);
+  free(ctx->str);
+  free(ctx);
+}
+
+/*
+ * Splits len chars of a BIO-formatted string in lines and token
+ * columns, the same way wapiti's reader does. Empty lines are skipped
+ * and, if lbl is set, the last column of each line is taken as its
+ * label. Nothing is copied, the context only references str.
+ */
+void ctx_split(api_ctx_t *ctx, const char *str, size_t len, bool lbl) {
+  const char *end = str + len;
+  uint32_t T = 0;
+  ctx->ncell = 0;
+  ctx->nbn = 0;
+  ctx->post = false;
+
+  while (str < end) {
+    // Find the next non-empty line
+    if (*str == '\n') {
+      str++;
+      continue;
+    }
+    const char *line = str;
+    while (str < end && *str != '\n')
+      str++;
+
+    ctx_reserve(ctx, T + 1);
+    ctx->lines[T].str = line;
+    ctx->lines[T].len = str - line;
+    ctx->first[T] = ctx->ncell;
+
+    // Split it in whitespace separated columns
+    uint32_t cnt = 0;
+    for (const char *pos = line; pos < str; ) {
+      if (isspace((unsigned char)*pos)) {
+        pos++;
+        continue;
+      }
+      const char *tok = pos;
+      while (pos < str && !isspace((unsigned char)*pos))
+        pos++;
+      ctx->cells = ctx_grow(ctx->cells, &ctx->cellsz, ctx->ncell + 1,
+                            sizeof(api_span_t));
+      ctx->cells[ctx->ncell].str = tok;
+      ctx->cells[ctx->ncell].len = pos - tok;
+      ctx->ncell++;
+      cnt++;
+    }
+
+    // Move the label out of the token columns
+    if (lbl) {
+      if (cnt == 0)
+        fatal("missing label at line %"PRIu32, T + 1);
+      ctx->lbls[T] = ctx->cells[--ctx->ncell];
+      cnt--;
+    }
+    ctx->cnts[T++] = cnt;
+  }
+  ctx->len = T;
+}
+
+/*
+ * Takes T positions of C columns already split by the caller, the cell
+ * of column c at position t is cells[t * C + c]. If lbl is set, the
+ * last column is the label. The spans are copied, not the strings, and
+ * the positions have no input line.
+ */
+void ctx_columns(api_ctx_t *ctx, const api_span_t cells[], uint32_t T,
+                 uint32_t C, bool lbl) {
+  static const api_span_t noline = {"", 0};
+  if (lbl && C == 0)
+    fatal("missing label column");
+  const uint32_t K = C - lbl;
+  ctx->nbn = 0;
+  ctx->post = false;
+  ctx_reserve(ctx, T);
+  ctx->cells = ctx_grow(ctx->cells, &ctx->cellsz, (size_t)T * K + 1,
+                        sizeof(api_span_t));
+  for (uint32_t t = 0; t < T; t++) {
+    const api_span_t *row = cells + (size_t)t * C;
+    memcpy(ctx->cells + (size_t)t * K, row, sizeof(api_span_t) * K);
+    ctx->lines[t] = noline;
+    ctx->first[t] = t * K;
+    ctx->cnts[t] = K;
+    if (lbl)
+      ctx->lbls[t] = row[K];
+  }
+  ctx->ncell = (size_t)T * K;
+  ctx->len = T;
+}
+
+/*
+ * Takes an already built sequence for decoding, its positions are
+ * copied but their observations are only referenced. Its labels are
+ * never forced, they are the reference the output is compared to.
+ */
+void ctx_loadseq(api_ctx_t *ctx, const seq_t *seq) {
+  ctx->nbn = 0;
+  ctx->post = false;
+  ctx->force = false;
+  ctx_reserve(ctx, max(seq->len, 1u));
+  ctx->seq->len = seq->len;
+  ctx->seq->raw = NULL;
+  memcpy(ctx->seq->pos, seq->pos, sizeof(pos_t) * seq->len);
+  ctx->len = seq->len;
+}
+
+/* Copies a span to the NUL terminated cell scratch buffer */
+static char *ctx_cellstr(api_ctx_t *ctx, api_span_t span) {
+  ctx->cell = ctx_grow(ctx->cell, &ctx->cellbufsz, span.len + 1, 1);
+  memcpy(ctx->cell, span.str, span.len);
+  ctx->cell[span.len] = '\0';
+  return ctx->cell;
+}
+
+/* Appends len chars to a string buffer at pos, lowercased if caps */
+static size_t ctx_append(char **buf, size_t *size, size_t pos,
+                         const char *str, size_t len, bool caps) {
+  *buf = ctx_grow(*buf, size, pos + len + 1, 1);
+  memcpy(*buf + pos, str, len);
+  if (caps)
+    for (size_t i = pos; i < pos + len; i++)
+      (*buf)[i] = tolower((unsigned char)(*buf)[i]);
+  return pos + len;
+}
+
+/*
+ * Returns the cell a pattern item refers to at position at. Positions
+ * out of the sequence get the same placeholders as in wapiti's
+ * pat_exec.
+ */
+static api_span_t ctx_itemcell(const api_ctx_t *ctx, const pat_item_t *item,
+                               uint32_t at) {
+  static const char *bval[] = {"_x-1", "_x-2", "_x-3", "_x-4", "_x-#"};
+  static const char *eval[] = {"_x+1", "_x+2", "_x+3", "_x+4", "_x+#"};
+  const int32_t T = ctx->len;
+  api_span_t span;
+
+  int32_t pos = item->offset;
+  if (item->absolute) {
+    if (item->offset < 0)
+      pos += T;
+    else
+      pos--;
+  } else {
+    pos += at;
+  }
+
+  if (pos < 0) {
+    span.str = bval[min(-pos - 1, 4)];
+    span.len = 4;
+  } else if (pos >= T) {
+    span.str = eval[min(pos - T, 4)];
+    span.len = 4;
+  } else if (item->column >= ctx->cnts[pos]) {
+    fatal("missing tokens, cannot apply pattern");
+    span.str = "";
+    span.len = 0;
+  } else {
+    span = ctx->cells[ctx->first[pos] + item->column];
+  }
+  return span;
+}
+
+/*
+ * Runs a regex test or match item on a cell through pat_exec, so it
+ * keeps wapiti's exact regex semantics. The result must be freed.
+ */
+static char *ctx_regex(api_ctx_t *ctx, const pat_item_t *item,
+                       api_span_t span) {
+  ctx->atom->items[0] = *item;
+  ctx->atom->items[0].absolute = false;
+  ctx->atom->items[0].offset = 0;
+  ctx->atom->items[0].column = 0;
+  ctx->tokcell[0] = ctx_cellstr(ctx, span);
+  return pat_exec(ctx->atom, ctx->tok, 0);
+}
+
+/*
+ * Builds the observation string of a pattern at position at in the
+ * feature buffer and returns its length. This is the item by item
+ * path, used when the model has no up to date pattern program.
+ */
+static size_t ctx_patexec(api_ctx_t *ctx, const pat_t *pat, uint32_t at) {
+  size_t pos = 0;
+  for (uint32_t i = 0; i < pat->nitems; i++) {
+    const pat_item_t *item = &pat->items[i];
+    if (item->type == 's') {
+      pos = ctx_append(&ctx->buf, &ctx->bufsz, pos, item->value,
+                       strlen(item->value), false);
+      continue;
+    }
+    api_span_t span = ctx_itemcell(ctx, item, at);
+    if (item->type == 'x') {
+      pos = ctx_append(&ctx->buf, &ctx->bufsz, pos, span.str, span.len,
+                       item->caps);
+      continue;
+    }
+    char *val = ctx_regex(ctx, item, span);
+    pos = ctx_append(&ctx->buf, &ctx->bufsz, pos, val, strlen(val), false);
+    free(val);
+  }
+  ctx->buf = ctx_grow(ctx->buf, &ctx->bufsz, pos + 1, 1);
+  ctx->buf[pos] = '\0';
+  return pos;
+}
+
+/*
+ * Runs the pattern program at position at. Every atom is evaluated
+ * once in the values buffer, then the observation strings are built in
+ * program order, each one on top of the prefix it shares with the
+ * previous one, and stored in the strings buffer.
+ *
+ * Lookups are left to the caller, in reader order, so training quarks
+ * give observations the same ids as with rdr_raw2seq.
+ */
+static void ctx_prgexec(api_ctx_t *ctx, const prg_t *prg, uint32_t at,
+                        bool local) {
+  size_t pos = 0;
+  for (uint32_t a = 0; a < prg->natoms; a++) {
+    const pat_item_t *item = &prg->atoms[a];
+    if (!local && !prg->actx[a])
+      continue;
+    api_span_t span = ctx_itemcell(ctx, item, at);
+    ctx->voff[a] = pos;
+    if (item->type == 'x') {
+      pos = ctx_append(&ctx->vbuf, &ctx->vbufsz, pos, span.str, span.len,
+                       item->caps);
+    } else {
+      char *val = ctx_regex(ctx, item, span);
+      pos = ctx_append(&ctx->vbuf, &ctx->vbufsz, pos, val, strlen(val),
+                       false);
+      free(val);
+    }
+    ctx->vlen[a] = pos - ctx->voff[a];
+  }
+
+  pos = 0;
+  const uint32_t P = local ? prg->npats : prg->nctx;
+  for (uint32_t p = 0; p < P; p++) {
+    const prg_pat_t *pat = &prg->pats[p];
+    size_t len = pat->share != 0 ? ctx->mark[pat->share - 1] : 0;
+    for (uint32_t i = pat->share; i < pat->nops; i++) {
+      const prg_op_t *op = &pat->ops[i];
+      if (op->atom == prg_lit)
+        len = ctx_append(&ctx->buf, &ctx->bufsz, len, op->str, op->len,
+                         false);
+      else
+        len = ctx_append(&ctx->buf, &ctx->bufsz, len,
+                         ctx->vbuf + ctx->voff[op->atom],
+                         ctx->vlen[op->atom], false);
+      ctx->mark[i] = len;
+    }
+    ctx->foff[pat->pat] = pos;
+    pos = ctx_append(&ctx->fbuf, &ctx->fbufsz, pos, ctx->buf, len, false);
+    ctx->fbuf[pos++] = '\0';
+  }
+}
+
+/*
+ * Models without patterns take their features straight from the token
+ * columns, each cell being an observation whose first char gives its
+ * kind, like wapiti's reader does. Unigrams are looked up before the
+ * bigrams, in the same order as rdr_raw2seq, so training gives them the
+ * same ids.
+ */
+static seq_t *ctx_rawtok(mdl_t *mdl, api_ctx_t *ctx, bool lbl) {
+  rdr_t *rdr = mdl->reader;
+  const uint32_t T = ctx->len;
+  ctx_reserve(ctx, max(T, 1u));
+  ctx->obs = ctx_grow(ctx->obs, &ctx->obssz, ctx->ncell * 2 + 1,
+                      sizeof(uint64_t));
+  seq_t *seq = ctx->seq;
+  seq->len = T;
+  seq->raw = ctx->obs;
+  ctx->force = lbl && mdl->opt->force;
+
+  uint64_t *tmp = ctx->obs;
+  ctx->nunk = 0;
+  for (uint32_t t = 0; t < T; t++) {
+    const api_span_t *cells = ctx->cells + ctx->first[t];
+    const uint32_t C = ctx->cnts[t];
+    pos_t *pos = &seq->pos[t];
+    pos->lbl = (uint32_t)-1;
+    for (uint32_t c = 0; c < C; c++) {
+      const char kind = cells[c].len != 0 ? cells[c].str[0] : '\0';
+      if (kind != 'u' && kind != 'b' && kind != '*')
+        fatal("invalid feature: %s", ctx_cellstr(ctx, cells[c]));
+    }
+    pos->ucnt = 0;
+    pos->uobs = tmp;
+    for (uint32_t c = 0; c < C; c++) {
+      if (cells[c].str[0] == 'b')
+        continue;
+      const uint64_t id = ext_obs2id(mdl, ctx_cellstr(ctx, cells[c]));
+      ctx->nunk += id == qrk_none;
+      if (id != qrk_none)
+        pos->uobs[pos->ucnt++] = id;
+    }
+    tmp += pos->ucnt;
+    pos->bcnt = 0;
+    pos->bobs = tmp;
+    for (uint32_t c = 0; c < C; c++) {
+      if (cells[c].str[0] == 'u')
+        continue;
+      const uint64_t id = ext_obs2id(mdl, ctx_cellstr(ctx, cells[c]));
+      ctx->nunk += id == qrk_none && cells[c].str[0] == 'b';
+      if (id != qrk_none)
+        pos->bobs[pos->bcnt++] = id;
+    }
+    tmp += pos->bcnt;
+    if (lbl)
+      pos->lbl = qrk_str2id(rdr->lbl, ctx_cellstr(ctx, ctx->lbls[t]));
+  }
+  return seq;
+}
+
+/*
+ * Applies the model patterns to the tokenized input and builds the
+ * internal sequence in the context buffers, like rdr_raw2seq would.
+ * Models without patterns use the tokens themselves, see ctx_rawtok.
+ * The returned sequence is owned by the context and only valid until
+ * its next use.
+ *
+ * As long as the model quarks are locked, this only reads the model,
+ * apart from its token cache which has its own lock.
+ */
+seq_t *ctx_raw2seq(mdl_t *mdl, api_ctx_t *ctx, bool lbl) {
+  rdr_t *rdr = mdl->reader;
+  const uint32_t T = ctx->len;
+  const uint32_t P = rdr->nuni + rdr->nbi;
+  seq_t *seq;
+
+  if (rdr->npats == 0)
+    return ctx_rawtok(mdl, ctx, lbl);
+  ctx_reserve(ctx, max(T, 1u));
+  ctx->obs = ctx_grow(ctx->obs, &ctx->obssz, (size_t)P * T + 1,
+                      sizeof(uint64_t));
+  seq = ctx->seq;
+  seq->len = T;
+  seq->raw = ctx->obs;
+  ctx->force = lbl && mdl->opt->force;
+
+  // Use the pattern program unless the patterns changed behind it
+  const prg_t *prg = mdl_ext(mdl)->prg;
+  if (prg != NULL && prg->npats != rdr->npats)
+    prg = NULL;
+  if (prg != NULL) {
+    size_t valsz = ctx->valsz;
+    ctx->voff  = ctx_grow(ctx->voff, &valsz, prg->natoms + 1,
+                          sizeof(size_t));
+    ctx->vlen  = ctx_grow(ctx->vlen, &ctx->valsz, prg->natoms + 1,
+                          sizeof(uint32_t));
+    ctx->mark  = ctx_grow(ctx->mark, &ctx->marksz, prg->maxops + 1,
+                          sizeof(size_t));
+    ctx->foff  = ctx_grow(ctx->foff, &ctx->foffsz, prg->npats + 1,
+                          sizeof(size_t));
+    size_t tidsz = ctx->tidsz;
+    ctx->tids  = ctx_grow(ctx->tids, &tidsz, prg->nlocal + 1,
+                          sizeof(uint64_t));
+    ctx->tkind = ctx_grow(ctx->tkind, &ctx->tidsz, prg->nlocal + 1, 1);
+  }
+
+  uint64_t *tmp = ctx->obs;
+  ctx->nunk = 0;
+  for (uint32_t t = 0; t < T; t++) {
+    pos_t *pos = &seq->pos[t];
+    pos->lbl  = (uint32_t)-1;
+    pos->ucnt = 0;
+    pos->uobs = tmp;
+    tmp += rdr->nuni;
+    pos->bcnt = 0;
+    pos->bobs = tmp;
+    tmp += rdr->nbi;
+
+    // Known tokens already have the observations of local patterns, so
+    // only the others are run for them
+    const uint64_t *cids = NULL;
+    const char *ckind = NULL;
+    if (prg != NULL) {
+      cids = tkc_get(mdl, ctx, t, &ckind);
+      ctx_prgexec(ctx, prg, t, cids == NULL);
+    }
+    for (uint32_t x = 0; x < rdr->npats; x++) {
+      const uint32_t l = prg != NULL ? prg->lidx[x] : prg_lit;
+      uint64_t id;
+      char kind;
+      if (cids != NULL && l != prg_lit) {
+        id = cids[l];
+        kind = ckind[l];
+      } else {
+        const char *str = ctx->buf;
+        if (prg != NULL)
+          str = ctx->fbuf + ctx->foff[x];
+        else
+          ctx_patexec(ctx, rdr->pats[x], t);
+        id = ext_obs2id(mdl, str);
+        kind = id != qrk_none ? str[0] : 0;
+        if (l != prg_lit) {
+          ctx->tids[l] = id;
+          ctx->tkind[l] = kind;
+        }
+      }
+      ctx->nunk += kind == 0;
+      switch (kind) {
+        case 'u': pos->uobs[pos->ucnt++] = id; break;
+        case 'b': pos->bobs[pos->bcnt++] = id; break;
+        case '*': pos->uobs[pos->ucnt++] = id;
+          pos->bobs[pos->bcnt++] = id; break;
+      }
+    }
+    if (prg != NULL && cids == NULL)
+      tkc_put(mdl, ctx);
+
+    if (lbl)
+      pos->lbl = qrk_str2id(rdr->lbl, ctx_cellstr(ctx, ctx->lbls[t]));
+  }
+  return seq;
+}
+
+/*
+ * Builds the lattice of the context sequence in ctx->psi, the score of
+ * every transition at every position. The lattice is transposed, with
+ * the previous label last, and padded to a multiple of the vector
+ * width with -inf transitions, so the decoder inner loops over
+ * previous labels are contiguous:
+ *     psi[t][y][yp]  for  yp < Yp = smd_padded(Y)
+ * MEMM scores are normalized in log space.
+ *
+ * With ctx->force, like wapiti's --force, positions whose label is
+ * known to the model can only take it: every transition into another
+ * label is set to -inf, so all decoders keep them.
+ */
+static void ctx_lattice(mdl_t *mdl, api_ctx_t *ctx) {
+  const seq_t *seq = ctx->seq;
+  const uint32_t Y = mdl->nlbl, Yp = smd_padded(Y);
+  const uint32_t T = seq->len;
+
+  ctx->psi = ctx_grow(ctx->psi, &ctx->psisz, (size_t)T * Y * Yp,
+                      sizeof(double));
+  ctx->sum = ctx_grow(ctx->sum, &ctx->sumsz, (size_t)Y * Y, sizeof(double));
+  double (*psi)[Y][Yp] = (void *)ctx->psi;
+  double *sum = ctx->sum;
+
+  // Unigram scores are shared by all previous labels, bigram scores are
+  // added on top for every transition after the first position.
+  for (uint32_t t = 0; t < T; t++) {
+    const pos_t *pos = &seq->pos[t];
+    for (uint32_t y = 0; y < Y; y++)
+      sum[y] = 0.0;
+    for (uint32_t n = 0; n < pos->ucnt; n++)
+      cmp_addblk(mdl, pos->uobs[n], false, sum);
+    for (uint32_t y = 0; y < Y; y++) {
+      for (uint32_t yp = 0; yp < Y; yp++)
+        psi[t][y][yp] = sum[y];
+      for (uint32_t yp = Y; yp < Yp; yp++)
+        psi[t][y][yp] = -HUGE_VAL;
+    }
+  }
+  for (uint32_t t = 1; t < T; t++) {
+    const pos_t *pos = &seq->pos[t];
+    if (pos->bcnt == 0)
+      continue;
+    for (uint32_t d = 0; d < Y * Y; d++)
+      sum[d] = 0.0;
+    for (uint32_t n = 0; n < pos->bcnt; n++)
+      cmp_addblk(mdl, pos->bobs[n], true, sum);
+    for (uint32_t yp = 0, d = 0; yp < Y; yp++)
+      for (uint32_t y = 0; y < Y; y++, d++)
+        psi[t][y][yp] += sum[d];
+  }
+  if (mdl->type == 1) {
+    for (uint32_t t = 0; t < T; t++) {
+      for (uint32_t yp = 0; yp < Y; yp++) {
+        double mx = psi[t][0][yp], tot = 0.0;
+        for (uint32_t y = 1; y < Y; y++)
+          mx = max(mx, psi[t][y][yp]);
+        for (uint32_t y = 0; y < Y; y++)
+          tot += exp(psi[t][y][yp] - mx);
+        const double lz = mx + log(tot);
+        for (uint32_t y = 0; y < Y; y++)
+          psi[t][y][yp] -= lz;
+      }
+    }
+  }
+  for (uint32_t t = 0; ctx->force && t < T; t++) {
+    const uint32_t lbl = seq->pos[t].lbl;
+    if (lbl >= Y)
+      continue;
+    for (uint32_t y = 0; y < Y; y++)
+      for (uint32_t yp = 0; y != lbl && yp < Yp; yp++)
+        psi[t][y][yp] = -HUGE_VAL;
+  }
+}
+
+/*
+ * Max-sum pass over the lattice keeping back-pointers, then walk them
+ * back from the best final label. This selects the same path as
+ * wapiti's tag_viterbi, and MEMM paths the same as its product of
+ * probabilities.
+ */
+static void ctx_maxsum(mdl_t *mdl, api_ctx_t *ctx) {
+  const uint32_t Y = mdl->nlbl, Yp = smd_padded(Y);
+  const uint32_t T = ctx->seq->len;
+
+  size_t ysz = ctx->ysz;
+  ctx->back = ctx_grow(ctx->back, &ctx->backsz, (size_t)T * Y,
+                       sizeof(uint32_t));
+  ctx->cur  = ctx_grow(ctx->cur, &ysz, Yp, sizeof(double));
+  ctx->old  = ctx_grow(ctx->old, &ctx->ysz, Yp, sizeof(double));
+  double   (*psi)[Y][Yp] = (void *)ctx->psi;
+  uint32_t (*back)[Y]    = (void *)ctx->back;
+  double   *cur = ctx->cur, *old = ctx->old;
+
+  for (uint32_t y = 0; y < Y; y++)
+    cur[y] = psi[0][y][0];
+  for (uint32_t y = Y; y < Yp; y++)
+    cur[y] = old[y] = -HUGE_VAL;
+  for (uint32_t t = 1; t < T; t++) {
+    for (uint32_t y = 0; y < Y; y++)
+      old[y] = cur[y];
+    for (uint32_t y = 0; y < Y; y++)
+      back[t][y] = smd_maxplus(old, psi[t][y], Yp, &cur[y]);
+  }
+  uint32_t bst = 0;
+  for (uint32_t y = 1; y < Y; y++)
+    if (cur[y] > cur[bst])
+      bst = y;
+  ctx->sc = cur[bst];
+  for (uint32_t t = T; t > 0; t--) {
+    const uint32_t yp = (t != 1) ? back[t - 1][bst] : 0;
+    ctx->out[t - 1] = bst;
+    ctx->psc[t - 1] = psi[t - 1][bst][yp];
+    bst = yp;
+  }
+}
+
+/*
+ * Scaled forward-backward over the lattice, leaving the posterior
+ * probability of each label at each position in alpha:
+ *     alpha[t][y]  for  y < Y, with rows of Yp items
+ * Transitions are exponentiated relative to the best one of their
+ * position, and both recursions are normalized at every position, as
+ * only the per-position marginals are needed. The forward recursion is
+ * a dot product and the backward one an axpy, both over contiguous
+ * previous labels.
+ */
+static void ctx_fwdbwd(mdl_t *mdl, api_ctx_t *ctx) {
+  const uint32_t Y = mdl->nlbl, Yp = smd_padded(Y);
+  const uint32_t T = ctx->seq->len;
+
+  size_t fbsz = ctx->fbsz;
+  ctx->alpha = ctx_grow(ctx->alpha, &fbsz, (size_t)T * Yp, sizeof(double));
+  ctx->beta  = ctx_grow(ctx->beta, &ctx->fbsz, (size_t)T * Yp,
+                        sizeof(double));
+  double (*psi)[Y][Yp] = (void *)ctx->psi;
+  double (*alpha)[Yp]  = (void *)ctx->alpha;
+  double (*beta)[Yp]   = (void *)ctx->beta;
+
+  for (uint32_t t = 0; t < T; t++) {
+    double mx = -HUGE_VAL;
+    for (uint32_t y = 0; y < Y; y++)
+      for (uint32_t yp = 0; yp < Y; yp++)
+        mx = max(mx, psi[t][y][yp]);
+    for (uint32_t y = 0; y < Y; y++)
+      for (uint32_t yp = 0; yp < Yp; yp++)
+        psi[t][y][yp] = exp(psi[t][y][yp] - mx);
+  }
+
+  for (uint32_t t = 0; t < T; t++) {
+    for (uint32_t y = 0; y < Y; y++)
+      alpha[t][y] = t != 0 ? xvm_dot(alpha[t - 1], psi[t][y], Yp)
+                           : psi[0][y][0];
+    for (uint32_t y = Y; y < Yp; y++)
+      alpha[t][y] = 0.0;
+    const double z = ctx_total(alpha[t], Y);
+    xvm_scale(alpha[t], alpha[t], 1.0 / z, Yp);
+  }
+
+  for (uint32_t y = 0; y < Yp; y++)
+    beta[T - 1][y] = y < Y ? 1.0 : 0.0;
+  for (uint32_t t = T - 1; t > 0; t--) {
+    for (uint32_t yp = 0; yp < Yp; yp++)
+      beta[t - 1][yp] = 0.0;
+    for (uint32_t y = 0; y < Y; y++)
+      xvm_axpy(beta[t - 1], beta[t][y], psi[t][y], beta[t - 1], Yp);
+    const double z = ctx_total(beta[t - 1], Y);
+    xvm_scale(beta[t - 1], beta[t - 1], 1.0 / z, Yp);
+  }
+
+  for (uint32_t t = 0; t < T; t++) {
+    for (uint32_t y = 0; y < Y; y++)
+      alpha[t][y] *= beta[t][y];
+    const double z = ctx_total(alpha[t], Y);
+    xvm_scale(alpha[t], alpha[t], 1.0 / z, Yp);
+  }
+}
+
+/*
+ * Decodes the context sequence into ctx->out, with path and
+ * per-position scores in ctx->sc and ctx->psc. This is wapiti's
+ * tag_viterbi working in the context buffers instead of allocating its
+ * own, and on compact weights as well. With posterior decoding, each
+ * position gets its most probable label and scores are the log of the
+ * posteriors. Pruned models go through prn_viterbi first, and only use
+ * the full lattice if pruning left no path. Labels known in the input
+ * are kept with opt->force, as tag_viterbi does.
+ */
+void ctx_viterbi(mdl_t *mdl, api_ctx_t *ctx) {
+  const uint32_t Y = mdl->nlbl, Yp = smd_padded(Y);
+  const uint32_t T = ctx->seq->len;
+
+  size_t outsz = ctx->outsz;
+  ctx->out = ctx_grow(ctx->out, &outsz, max(T, 1u), sizeof(uint32_t));
+  ctx->psc = ctx_grow(ctx->psc, &ctx->outsz, max(T, 1u), sizeof(double));
+  if (T == 0) {
+    ctx->sc = 0.0;
+    return;
+  }
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  if (!mdl->opt->lblpost && (ext->eoff != NULL || ext->beam != 0))
+    if (prn_viterbi(mdl, ctx))
+      return;
+  ctx_lattice(mdl, ctx);
+  if (!mdl->opt->lblpost) {
+    ctx_maxsum(mdl, ctx);
+    return;
+  }
+
+  ctx_fwdbwd(mdl, ctx);
+  double (*post)[Yp] = (void *)ctx->alpha;
+  ctx->sc = 0.0;
+  for (uint32_t t = 0; t < T; t++) {
+    uint32_t bst = 0;
+    for (uint32_t y = 1; y < Y; y++)
+      if (post[t][y] > post[t][bst])
+        bst = y;
+    ctx->out[t] = bst;
+    ctx->psc[t] = log(post[t][bst]);
+    ctx->sc += ctx->psc[t];
+  }
+}
+
+/*
+ * Inserts a candidate in a list of the n best scores and their
+ * back-pointers, sorted in decreasing order. A candidate only goes
+ * before strictly lower scores so, as in the Viterbi decoder, ties keep
+ * the first candidate seen.
+ */
+static void ctx_nbins(double sc[], uint32_t bk[], uint32_t n, double val,
+                      uint32_t ptr) {
+  if (!(val > sc[n - 1]))
+    return;
+  uint32_t i = n - 1;
+  while (i > 0 && val > sc[i - 1]) {
+    sc[i] = sc[i - 1];
+    bk[i] = bk[i - 1];
+    i--;
+  }
+  sc[i] = val;
+  bk[i] = ptr;
+}
+
+/*
+ * N-best Viterbi decoding of the context sequence, like wapiti's
+ * tag_nbviterbi: every label of every position keeps its N best
+ * partial paths, each with a back-pointer to a label and rank at the
+ * previous position. The paths end up in ctx->npath, best first, with
+ * their scores in ctx->nsc. If post is set, the posteriors of each
+ * label are also computed in ctx->alpha, see ctx_fwdbwd.
+ *
+ * Returns the number of paths found, which is less than N if the
+ * sequence doesn't have that many.
+ */
+uint32_t ctx_nbest(mdl_t *mdl, api_ctx_t *ctx, uint32_t N, bool post) {
+  const uint32_t Y = mdl->nlbl, Yp = smd_padded(Y);
+  const uint32_t T = ctx->seq->len;
+  ctx->nblbl = Y;
+  ctx->nbmax = N;
+  ctx->nbn = 0;
+  ctx->post = false;
+  if (T == 0 || N == 0)
+    return 0;
+
+  size_t nsz = ctx->nsz;
+  ctx->nsc = ctx_grow(ctx->nsc, &nsz, (size_t)T * Y * N + N,
+                      sizeof(double));
+  ctx->nbk = ctx_grow(ctx->nbk, &ctx->nsz, (size_t)T * Y * N + N,
+                      sizeof(uint32_t));
+  ctx->npath = ctx_grow(ctx->npath, &ctx->npathsz, (size_t)N * T,
+                        sizeof(uint32_t));
+  ctx_lattice(mdl, ctx);
+  double   (*psi)[Y][Yp] = (void *)ctx->psi;
+  double   (*sc)[Y][N]   = (void *)ctx->nsc;
+  uint32_t (*bk)[Y][N]   = (void *)ctx->nbk;
+
+  for (uint32_t y = 0; y < Y; y++) {
+    for (uint32_t k = 0; k < N; k++)
+      sc[0][y][k] = -HUGE_VAL;
+    sc[0][y][0] = psi[0][y][0];
+  }
+  for (uint32_t t = 1; t < T; t++) {
+    for (uint32_t y = 0; y < Y; y++) {
+      for (uint32_t k = 0; k < N; k++)
+        sc[t][y][k] = -HUGE_VAL;
+      for (uint32_t yp = 0; yp < Y; yp++)
+        for (uint32_t k = 0; k < N && sc[t - 1][yp][k] != -HUGE_VAL; k++)
+          ctx_nbins(sc[t][y], bk[t][y], N,
+                    sc[t - 1][yp][k] + psi[t][y][yp], yp * N + k);
+    }
+  }
+
+  // Pick the N best ends, then follow the back-pointers of each one
+  double   *fsc = ctx->nsc + (size_t)T * Y * N;
+  uint32_t *fbk = ctx->nbk + (size_t)T * Y * N;
+  for (uint32_t k = 0; k < N; k++)
+    fsc[k] = -HUGE_VAL;
+  for (uint32_t y = 0; y < Y; y++)
+    for (uint32_t k = 0; k < N && sc[T - 1][y][k] != -HUGE_VAL; k++)
+      ctx_nbins(fsc, fbk, N, sc[T - 1][y][k], y * N + k);
+  uint32_t (*path)[T] = (void *)ctx->npath;
+  uint32_t n;
+  for (n = 0; n < N && fsc[n] != -HUGE_VAL; n++) {
+    uint32_t ptr = fbk[n];
+    for (uint32_t t = T; t > 0; t--) {
+      const uint32_t y = ptr / N, k = ptr % N;
+      path[n][t - 1] = y;
+      ptr = t != 1 ? bk[t - 1][y][k] : 0;
+    }
+  }
+  ctx->nbn = n;
+
+  if (post) {
+    ctx_fwdbwd(mdl, ctx);
+    ctx->post = true;
+  }
+  return n;
+}
+
+/*
+ * Builds the labeled output in the context: every input line followed
+ * by a tab and its label. The string is owned by the context.
+ */
+const char *ctx_output(mdl_t *mdl, api_ctx_t *ctx) {
+  qrk_t *lbls = mdl->reader->lbl;
+  size_t pos = 0;
+
+  ctx->str = ctx_grow(ctx->str, &ctx->strsz, 1, 1);
+  for (uint32_t t = 0; t < ctx->len; t++) {
+    const char *lblstr = qrk_id2str(lbls, ctx->out[t]);
+    const size_t lbllen = strlen(lblstr);
+    const api_span_t line = ctx->lines[t];
+    // Size: input line  + \t + label + \n + \0
+    ctx->str = ctx_grow(ctx->str, &ctx->strsz, pos + line.len + lbllen + 3, 1);
+    memcpy(ctx->str + pos, line.str, line.len);
+    pos += line.len;
+    ctx->str[pos++] = '\t';
+    memcpy(ctx->str + pos, lblstr, lbllen);
+    pos += lbllen;
+    ctx->str[pos++] = '\n';
+  }
+  ctx->str[pos] = '\0';
+  ctx->slen = pos;
+  return ctx->str;
+}
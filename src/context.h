@@ -0,0 +1,154 @@
+#ifndef context_h
+#define context_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model.h"
+#include "pattern.h"
+#include "sequence.h"
+#include "api.h"
+
+/*
+ * Labeling contexts hold all the scratch memory needed to turn an
+ * input string into labels: the tokenized input, the internal
+ * sequence, the Viterbi lattice and the output string. Buffers only
+ * ever grow, so once a context has seen the longest sequence of a
+ * workload labeling does no more allocations.
+ *
+ * A context belongs to a single thread at a time, but can be used with
+ * any number of models.
+ */
+
+typedef struct api_ctx_s api_ctx_t;
+struct api_ctx_s {
+  // Tokenized input. Spans point into the caller's buffer
+  uint32_t    len;     //  T    length of the current sequence
+  uint32_t    size;    //       positions allocated in the arrays below
+  api_span_t *lines;   // [T]   raw input lines
+  api_span_t *lbls;    // [T]   label column, when input is labeled
+  uint32_t   *cnts;    // [T]   number of token columns per position
+  uint32_t   *first;   // [T]   index of the first column in cells
+  api_span_t *cells;   //       token columns of all positions
+  size_t      ncell, cellsz;
+
+  // The internal sequence handed to the decoder, and the number of its
+  // observations missing from the model. force is set when the decoder
+  // must keep the labels known in the input, see ctx_lattice.
+  seq_t      *seq;
+  uint64_t   *obs;
+  size_t      obssz;
+  uint64_t    nunk;
+  bool        force;
+
+  // Feature string being built and a NUL terminated copy of one cell
+  char       *buf;
+  size_t      bufsz;
+  char       *cell;
+  size_t      cellbufsz;
+
+  // Regex items are run through pat_exec as a one item pattern on a
+  // one token sequence holding the cell to match
+  pat_t      *atom;
+  tok_t      *tok;
+  char       *tokcell[1];
+  uint32_t    tokcnt[1];
+
+  // Pattern program state: the value of every atom at the current
+  // position, stored in vbuf, the feature string length after each op,
+  // and the observation strings of all patterns, stored in fbuf
+  size_t     *voff;    // [A]
+  uint32_t   *vlen;    // [A]
+  size_t      valsz;
+  char       *vbuf;
+  size_t      vbufsz;
+  size_t     *mark;    // [ops]
+  size_t      marksz;
+  size_t     *foff;    // [P]  indexed like the reader patterns
+  size_t      foffsz;
+  char       *fbuf;
+  size_t      fbufsz;
+
+  // Decoding lattice and results, Yp is Y padded for the vector
+  // kernels, see ctx_lattice
+  double     *psi;     // [T][Y][Yp]
+  uint32_t   *back;    // [T][Y]
+  double     *cur;     // [Yp]
+  double     *old;     // [Yp]
+  double     *sum;     // [Y][Y] features weights of one position
+  double     *alpha;   // [T][Yp] forward scores, then posteriors
+  double     *beta;    // [T][Yp]
+  uint32_t   *out;     // [T]
+  double     *psc;     // [T]
+  double      sc;
+  size_t      psisz, backsz, ysz, sumsz, fbsz, outsz;
+
+  // N-best decoding, see ctx_nbest. The scores of the final paths
+  // follow the per-position ones in nsc. post is set when alpha holds
+  // the posteriors of the last sequence.
+  double     *nsc;     // [T][Y][N] + [N]
+  uint32_t   *nbk;     // [T][Y][N] + [N]
+  uint32_t   *npath;   // [N][T]
+  size_t      nsz, npathsz;
+  uint32_t    nblbl;   //  Y    of the last decoding
+  uint32_t    nbmax;   //  N    paths asked for
+  uint32_t    nbn;     //       paths found
+  bool        post;
+
+  // Transitions taken at one position by the pruned decoder, see
+  // prune.c, as yp * Y + y, with their previous label and bigram score
+  uint32_t   *eidx;    // [E]
+  uint32_t   *esrc;    // [E]
+  double     *eacc;    // [E]
+  size_t      esz;
+
+  // Key of the current token in the token cache, see tokcache.c, and
+  // the observations of the local patterns for it, in reader order
+  char       *tkey;
+  size_t      tkeysz, tkeylen;
+  uint64_t    tkeyhash;
+  bool        tkeyok;
+  uint64_t   *tids;    // [L]
+  char       *tkind;   // [L]
+  size_t      tidsz;
+
+  // Key of the current input in the label cache, see cache.c
+  char       *key;
+  size_t      keysz, keylen;
+  uint64_t    keyhash;
+
+  // Output string
+  char       *str;
+  size_t      strsz, slen;
+
+  // Counters of the labeling done with the context, see stats.c
+  api_stats_t stats;
+};
+
+api_ctx_t *api_new_ctx(void);
+void api_free_ctx(api_ctx_t *ctx);
+
+void *ctx_grow(void *ptr, size_t *size, size_t cnt, size_t elem);
+void ctx_split(api_ctx_t *ctx, const char *str, size_t len, bool lbl);
+void ctx_columns(api_ctx_t *ctx, const api_span_t cells[], uint32_t T,
+                 uint32_t C, bool lbl);
+void ctx_loadseq(api_ctx_t *ctx, const seq_t *seq);
+seq_t *ctx_raw2seq(mdl_t *mdl, api_ctx_t *ctx, bool lbl);
+void ctx_viterbi(mdl_t *mdl, api_ctx_t *ctx);
+bool prn_viterbi(mdl_t *mdl, api_ctx_t *ctx);
+const uint64_t *tkc_get(mdl_t *mdl, api_ctx_t *ctx, uint32_t at,
+                        const char **kind);
+void tkc_put(mdl_t *mdl, api_ctx_t *ctx);
+bool lbc_get(mdl_t *mdl, api_ctx_t *ctx);
+void lbc_put(mdl_t *mdl, api_ctx_t *ctx);
+uint32_t ctx_nbest(mdl_t *mdl, api_ctx_t *ctx, uint32_t N, bool post);
+const char *ctx_output(mdl_t *mdl, api_ctx_t *ctx);
+void sts_decode(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len);
+void sts_columns(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                 uint32_t T, uint32_t C);
+uint32_t sts_nbest(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                   uint32_t n, bool post);
+const char *sts_output(mdl_t *mdl, api_ctx_t *ctx);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tools.h"
+#include "dict.h"
+
+/* Returned for strings missing from a dictionary, like qrk_str2id */
+static const uint64_t dct_none = (uint64_t)-1;
+
+/* Binary search of a string, returns its id or dct_none */
+uint64_t dct_str2id(const dct_t *dct, const char *str) {
+  uint64_t lo = 0, hi = dct->cnt;
+  while (lo < hi) {
+    const uint64_t mid = lo + (hi - lo) / 2;
+    const uint64_t id = dct->sorted[mid];
+    const int cmp = strcmp(str, dct->blob + dct->offs[id]);
+    if (cmp == 0)
+      return id;
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return dct_none;
+}
+
+const char *dct_id2str(const dct_t *dct, uint64_t id) {
+  return dct->blob + dct->offs[id];
+}
+
+/*
+ * 64-bit FNV-1a, with a final mix so the low bits used to index the
+ * table depend on the whole string.
+ */
+uint64_t fdc_hash(const char *str) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    h ^= *c;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Builds the table of a frozen dictionary over its strings. The table
+ * is kept at most half full so probe sequences stay short.
+ */
+static fdc_t *fdc_build(const char **strs, uint64_t cnt, char *blob) {
+  fdc_t *fdc = xmalloc(sizeof(fdc_t));
+  uint64_t size = 16;
+  while (size < 2 * cnt)
+    size *= 2;
+  fdc->cnt = cnt;
+  fdc->mask = size - 1;
+  fdc->slots = xmalloc(sizeof(fdc_slot_t) * size);
+  for (uint64_t i = 0; i < size; i++)
+    fdc->slots[i].id = dct_none;
+  fdc->strs = strs;
+  fdc->blob = blob;
+  for (uint64_t id = 0; id < cnt; id++) {
+    const uint64_t h = fdc_hash(strs[id]);
+    uint64_t i = h & fdc->mask;
+    while (fdc->slots[i].id != dct_none)
+      i = (i + 1) & fdc->mask;
+    fdc->slots[i].hash = h;
+    fdc->slots[i].id = id;
+  }
+  return fdc;
+}
+
+/* Builds a frozen dictionary with a copy of strs, strs[i] gets id i */
+fdc_t *fdc_new(const char **strs, uint64_t cnt) {
+  uint64_t len = 0;
+  for (uint64_t id = 0; id < cnt; id++)
+    len += strlen(strs[id]) + 1;
+  char *blob = xmalloc(len + 1);
+  const char **own = xmalloc(sizeof(char *) * (cnt + 1));
+  len = 0;
+  for (uint64_t id = 0; id < cnt; id++) {
+    own[id] = blob + len;
+    strcpy(blob + len, strs[id]);
+    len += strlen(strs[id]) + 1;
+  }
+  return fdc_build(own, cnt, blob);
+}
+
+/*
+ * Same as fdc_new, but only keeps pointers to the strings, which must
+ * outlive the dictionary. The dictionary takes over the strs array.
+ */
+fdc_t *fdc_share(const char **strs, uint64_t cnt) {
+  return fdc_build(strs, cnt, NULL);
+}
+
+void fdc_free(fdc_t *fdc) {
+  free(fdc->slots);
+  free(fdc->strs);
+  free(fdc->blob);
+  free(fdc);
+}
+
+/* Returns the id of a string, or dct_none if it is not in the table */
+uint64_t fdc_str2id(const fdc_t *fdc, const char *str) {
+  const uint64_t h = fdc_hash(str);
+  for (uint64_t i = h & fdc->mask; ; i = (i + 1) & fdc->mask) {
+    const fdc_slot_t *slot = &fdc->slots[i];
+    if (slot->id == dct_none)
+      return dct_none;
+    if (slot->hash == h && !strcmp(fdc->strs[slot->id], str))
+      return slot->id;
+  }
+}
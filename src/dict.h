@@ -0,0 +1,54 @@
+#ifndef dict_h
+#define dict_h
+
+#include <stdint.h>
+
+/*
+ * Immutable string dictionaries, as stored in binary model files.
+ *
+ * Strings are NUL terminated and stored back to back in id order in
+ * blob, with offs[id] the start of string id. sorted lists the ids in
+ * strcmp order so strings are found with a binary search. None of the
+ * arrays are owned by the dictionary, they usually live in a mapped
+ * file.
+ */
+typedef struct dct_s dct_t;
+struct dct_s {
+  uint64_t        cnt;
+  const uint64_t *offs;    // [cnt+1] string offsets in blob
+  const uint64_t *sorted;  // [cnt]   ids in string order
+  const char     *blob;
+};
+
+uint64_t dct_str2id(const dct_t *dct, const char *str);
+const char *dct_id2str(const dct_t *dct, uint64_t id);
+
+/*
+ * Frozen dictionaries are flat open-addressing hash tables built once
+ * from a list of strings and never modified afterwards, so lookups are
+ * lock-free by construction. Each slot holds the full 64-bit hash of
+ * its string, and the string itself is only compared when hashes
+ * match. Strings are either copied back to back in the dictionary, or
+ * shared with others through a string pool, see registry.c.
+ */
+typedef struct fdc_slot_s {
+  uint64_t  hash;
+  uint64_t  id;
+} fdc_slot_t;
+
+typedef struct fdc_s fdc_t;
+struct fdc_s {
+  uint64_t    cnt;
+  uint64_t    mask;    //        table size minus one
+  fdc_slot_t *slots;   // [mask+1]
+  const char **strs;   // [cnt]  strings, in blob unless shared
+  char       *blob;
+};
+
+uint64_t fdc_hash(const char *str);
+fdc_t *fdc_new(const char **strs, uint64_t cnt);
+fdc_t *fdc_share(const char **strs, uint64_t cnt);
+void fdc_free(fdc_t *fdc);
+uint64_t fdc_str2id(const fdc_t *fdc, const char *str);
+
+#endif
@@ -0,0 +1,267 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "quark.h"
+#include "reader.h"
+#include "sequence.h"
+#include "gradient.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Distributed training
+ *
+ * Each node of a training holds a shard of the training data in its own
+ * copy of the model, and all of them run the same trainer in lockstep.
+ * The Makefile wraps grd_gradient, so the gradient and objective each
+ * node computes on its shard are summed over all the nodes before the
+ * trainer sees them. As the sum is the same everywhere, so are the steps
+ * taken, and the weights stay identical without ever being sent. Only
+ * trainers going through grd_gradient can run this way: l-bfgs and the
+ * rprop variants.
+ *
+ * This needs every node to compute the steps with bitwise identical
+ * arithmetic, which the vector kernels of simd.c don't give across
+ * CPUs: the AVX-512, AVX2 and plain versions round differently. So
+ * before each gradient the nodes compare a hash of their weights, and
+ * if any differs from the one of rank 0 all of them take its weights.
+ * This keeps mixed clusters consistent, but costs an extra exchange of
+ * the weights for almost every gradient, so all the nodes should share
+ * the same instruction set.
+ *
+ * Before that, ext_sync merges the label and observation dictionaries
+ * of the nodes so the weights have the same meaning everywhere. Both
+ * are rebuilt in rank order after the entries the model already had,
+ * which all nodes must share, starting from the same model file or
+ * from none. Hashed models only merge their labels. The counts of the
+ * frequency cutoff are summed as well, so it drops the same
+ * observations on every node.
+ *
+ * The nodes must be set up with the same options, and a trainer stops
+ * on all of them as soon as one of them wants it to.
+ */
+
+double __real_grd_gradient(grd_t *grd);
+
+/*
+ * Sets the transport the model trains over, or NULL to train alone.
+ * The transport must outlive the training.
+ */
+void api_set_dist(mdl_t *mdl, api_dist_t *dist) {
+  mdl_ext(mdl)->dist = dist;
+}
+
+static inline api_dist_t *dst_get(mdl_t *mdl) {
+  api_dist_t *dist = mdl_ext(mdl)->dist;
+  return dist != NULL && dist->size > 1 ? dist : NULL;
+}
+
+/*
+ * Merges the entries of a quark from K on with the ones of the other
+ * nodes. Returns the new quark and stores in map the new id of each
+ * entry of the old one.
+ */
+static qrk_t *dst_union(api_dist_t *dist, qrk_t *qrk, uint64_t K,
+                        uint64_t **map) {
+  const uint64_t Q = qrk_count(qrk);
+  size_t len = 0;
+  for (uint64_t q = K; q < Q; q++)
+    len += strlen(qrk_id2str(qrk, q)) + 1;
+  char *buf = xmalloc(len + 1), *cur = buf;
+  for (uint64_t q = K; q < Q; q++) {
+    const char *str = qrk_id2str(qrk, q);
+    const size_t n = strlen(str) + 1;
+    memcpy(cur, str, n);
+    cur += n;
+  }
+  size_t *lens = xmalloc(sizeof(size_t) * dist->size);
+  char *all = dist->allgather(dist, buf, len, lens);
+  free(buf);
+
+  qrk_t *res = qrk_new();
+  for (uint64_t q = 0; q < K; q++)
+    qrk_str2id(res, qrk_id2str(qrk, q));
+  cur = all;
+  for (uint32_t r = 0; r < dist->size; r++) {
+    const char *end = cur + lens[r];
+    while (cur < end) {
+      qrk_str2id(res, cur);
+      cur += strlen(cur) + 1;
+    }
+  }
+  free(all);
+  free(lens);
+
+  *map = xmalloc(sizeof(uint64_t) * (Q + 1));
+  for (uint64_t q = 0; q < Q; q++)
+    (*map)[q] = q < K ? q : qrk_str2id(res, qrk_id2str(qrk, q));
+  qrk_lock(res, qrk_lock(qrk, false));
+  return res;
+}
+
+/* Maps the labels and the observations of a data set */
+static void dst_remap(dat_t *dat, const uint64_t lmap[],
+                      const uint64_t omap[]) {
+  if (dat == NULL)
+    return;
+  for (uint32_t s = 0; s < dat->nseq; s++) {
+    seq_t *seq = dat->seq[s];
+    for (uint32_t t = 0; t < seq->len; t++) {
+      pos_t *pos = &seq->pos[t];
+      pos->lbl = lmap[pos->lbl];
+      if (omap == NULL)
+        continue;
+      for (uint32_t i = 0; i < pos->ucnt; i++)
+        pos->uobs[i] = omap[pos->uobs[i]];
+      for (uint32_t i = 0; i < pos->bcnt; i++)
+        pos->bobs[i] = omap[pos->bobs[i]];
+    }
+  }
+}
+
+/*
+ * Agrees with the other nodes on the dictionaries the model is about to
+ * be sized for, see above.
+ */
+void dst_dict(mdl_t *mdl) {
+  api_dist_t *dist = dst_get(mdl);
+  if (dist == NULL)
+    return;
+  rdr_t *rdr = mdl->reader;
+  uint64_t *lmap, *omap = NULL;
+  qrk_t *lbl = dst_union(dist, rdr->lbl, mdl->nlbl, &lmap);
+  qrk_t *obs = NULL;
+  if (mdl_ext(mdl)->hbits == 0)
+    obs = dst_union(dist, rdr->obs, mdl->nobs, &omap);
+  dst_remap(mdl->train, lmap, omap);
+  dst_remap(mdl->devel, lmap, omap);
+  free(lmap);
+  free(omap);
+  qrk_free(rdr->lbl);
+  rdr->lbl = lbl;
+  if (obs != NULL) {
+    qrk_free(rdr->obs);
+    rdr->obs = obs;
+  }
+  tkc_clear(mdl);
+  info("* Merged dictionaries of %"PRIu32" nodes: %"PRIu64" labels, "
+       "%"PRIu64" observations\n", dist->size, qrk_count(rdr->lbl),
+       qrk_count(rdr->obs));
+}
+
+/* Sums the cutoff counts of the nodes, saturating like the local ones */
+void dst_count(mdl_t *mdl, uint32_t cnt[], uint64_t n) {
+  api_dist_t *dist = dst_get(mdl);
+  if (dist == NULL)
+    return;
+  double *tmp = xmalloc(sizeof(double) * (n + 1));
+  for (uint64_t i = 0; i < n; i++)
+    tmp[i] = cnt[i];
+  dist->allreduce(dist, tmp, n);
+  for (uint64_t i = 0; i < n; i++)
+    cnt[i] = tmp[i] < UINT32_MAX ? (uint32_t)tmp[i] : UINT32_MAX;
+  free(tmp);
+}
+
+/*
+ * Returns whether all the nodes want to go on with training, called at
+ * the end of each iteration.
+ */
+bool dst_agree(mdl_t *mdl, bool go) {
+  api_dist_t *dist = dst_get(mdl);
+  if (dist == NULL)
+    return go;
+  double stop = go ? 0.0 : 1.0;
+  dist->allreduce(dist, &stop, 1);
+  return stop == 0.0;
+}
+
+/*
+ * Sums the gradient and objective of the nodes. Each one adds the
+ * elastic-net penalty to its share, so all but the first take it back
+ * out before the sum.
+ */
+static double dst_sum(mdl_t *mdl, api_dist_t *dist, double g[], double fx) {
+  const uint64_t F = mdl->nftr;
+  const double *x = mdl->theta;
+  if (dist->rank != 0) {
+    const double rho1 = mdl->opt->rho1;
+    const double rho2 = mdl->opt->rho2;
+    double nl1 = 0.0, nl2 = 0.0;
+    for (uint64_t f = 0; f < F; f++) {
+      const double v = x[f];
+      g[f] -= rho2 * v;
+      nl1  += fabs(v);
+      nl2  += v * v;
+    }
+    fx -= nl1 * rho1 + nl2 * rho2 / 2.0;
+  }
+  dist->allreduce(dist, g, F);
+  dist->allreduce(dist, &fx, 1);
+  return fx;
+}
+
+/* FNV-1a over the bits of the weights, with a final mix */
+static uint64_t dst_hash(const double x[], uint64_t n) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t v;
+    memcpy(&v, &x[i], sizeof(v));
+    h ^= v;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Checks that the weights are the same on all the nodes, and replaces
+ * them with the ones of rank 0 if not, by summing them with zeros from
+ * the others. All the nodes see the same hashes, so they agree on it.
+ */
+static void dst_check(mdl_t *mdl, api_dist_t *dist) {
+  const uint64_t F = mdl->nftr;
+  double *x = mdl->theta;
+  const uint64_t h = dst_hash(x, F);
+  size_t *lens = xmalloc(sizeof(size_t) * dist->size);
+  uint64_t *all = dist->allgather(dist, &h, sizeof(h), lens);
+  bool same = true;
+  for (uint32_t r = 1; r < dist->size; r++)
+    same = same && all[r] == all[0];
+  free(all);
+  free(lens);
+  if (same)
+    return;
+  if (dist->rank != 0)
+    memset(x, 0, sizeof(double) * F);
+  dist->allreduce(dist, x, F);
+}
+
+/*
+ * Computes the gradient and objective over the data of all the nodes,
+ * on the active set if enabled, see active.c. It is chosen from the
+ * sum, so it is the same on every node.
+ */
+double __wrap_grd_gradient(grd_t *grd) {
+  mdl_t *mdl = grd->mdl;
+  api_dist_t *dist = dst_get(mdl);
+  if (dist != NULL)
+    dst_check(mdl, dist);
+  const bool shrunk = act_enter(mdl);
+  double fx = __real_grd_gradient(grd);
+  double *g = grd->grd_st[0]->g;
+  if (dist != NULL)
+    fx = dst_sum(mdl, dist, g, fx);
+  act_leave(mdl, g, shrunk);
+  return fx;
+}
@@ -0,0 +1,267 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "sequence.h"
+#include "thread.h"
+#include "tools.h"
+#include "api.h"
+#include "arena.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Precompiled evaluation sets
+ *
+ * Labeled sequences are turned into observation ids once, like the
+ * training data, and kept with their reference labels. Any number of
+ * snapshots of the model can then be scored against them: only
+ * decoding is left, done by opt->nthread workers, each with its own
+ * labeling context. The ids belong to the dictionary of the model the
+ * set was compiled with, so it can be used with that model all along a
+ * training, with checkpoints of it, or with any model sharing its
+ * dictionary, which is checked by size only.
+ */
+struct api_evs_s {
+  mdl_t      *mdl;        // Model the set was compiled with
+  uint64_t    nobs;       //      and the size of its dictionaries
+  uint32_t    nlbl;
+  api_ctx_t  *ctx;        // Compilation scratch
+  arn_t      *arena;      // Storage of the sequences
+  seq_t     **seq;        // [S]
+  uint32_t    nseq, size;
+  uint64_t   *off;        // [S+1] first token of each sequence in out
+  uint32_t   *out;        // [N]   labels found by the last evaluation
+  uint64_t   *cnt;        // [3][Y] true and false positives, false
+                          //        negatives of each label, idem
+  api_ctx_t **wctx;       // [W]   decoding contexts, one per worker
+  uint32_t    nwctx;
+};
+
+/* Size of the evaluation arena chunks */
+#define evs_arnsz (8 << 20)
+
+/* Returned for reference labels unknown to the model */
+static const uint32_t evs_none = (uint32_t)-1;
+
+/*
+ * Creates an empty evaluation set for the model, which must not change
+ * its dictionaries while sequences are added.
+ */
+api_evs_t *api_new_evalset(mdl_t *mdl) {
+  api_evs_t *evs = xmalloc(sizeof(api_evs_t));
+  evs->mdl = mdl;
+  evs->nobs = mdl->nobs;
+  evs->nlbl = mdl->nlbl;
+  evs->ctx = api_new_ctx();
+  evs->arena = arn_new(evs_arnsz);
+  evs->seq = NULL;
+  evs->nseq = evs->size = 0;
+  evs->off = xmalloc(sizeof(uint64_t));
+  evs->off[0] = 0;
+  evs->out = NULL;
+  evs->cnt = xmalloc(sizeof(uint64_t) * 3 * (evs->nlbl + 1));
+  memset(evs->cnt, 0, sizeof(uint64_t) * 3 * (evs->nlbl + 1));
+  evs->wctx = NULL;
+  evs->nwctx = 0;
+  return evs;
+}
+
+void api_free_evalset(api_evs_t *evs) {
+  for (uint32_t w = 0; w < evs->nwctx; w++)
+    api_free_ctx(evs->wctx[w]);
+  free(evs->wctx);
+  api_free_ctx(evs->ctx);
+  arn_free(evs->arena);
+  free(evs->seq);
+  free(evs->off);
+  free(evs->out);
+  free(evs->cnt);
+  free(evs);
+}
+
+/*
+ * Builds the sequence held in the compilation context against the
+ * locked dictionaries, so observations unknown to the model are left
+ * out like when labeling, and stores it.
+ */
+static void evs_store(api_evs_t *evs) {
+  mdl_t *mdl = evs->mdl;
+  if (mdl->nobs != evs->nobs || mdl->nlbl != evs->nlbl)
+    fatal("model changed since the evaluation set was created");
+  const bool lock = ext_grow(mdl, true);
+  const seq_t *seq = ctx_raw2seq(mdl, evs->ctx, true);
+  ext_grow(mdl, lock);
+  if (evs->nseq == evs->size) {
+    evs->size = max(evs->size * 2, 64u);
+    evs->seq = xrealloc(evs->seq, sizeof(seq_t *) * evs->size);
+    evs->off = xrealloc(evs->off, sizeof(uint64_t) * (evs->size + 1));
+  }
+  // Labels of the last evaluation no longer cover the set
+  free(evs->out);
+  evs->out = NULL;
+  evs->seq[evs->nseq] = ext_copyseq(evs->arena, seq);
+  evs->off[evs->nseq + 1] = evs->off[evs->nseq] + seq->len;
+  evs->nseq++;
+}
+
+/* Adds a labeled BIO-formatted sequence to the set */
+void api_evalset_add(api_evs_t *evs, const char *lines) {
+  ctx_split(evs->ctx, lines, strlen(lines), true);
+  evs_store(evs);
+}
+
+/*
+ * Adds a labeled sequence of T positions of C columns, laid out like
+ * for api_add_train_cols.
+ */
+void api_evalset_add_cols(api_evs_t *evs, const api_span_t cells[],
+                          uint32_t T, uint32_t C) {
+  ctx_columns(evs->ctx, cells, T, C, true);
+  evs_store(evs);
+}
+
+/* Returns the number of sequences in the set */
+uint32_t api_evalset_count(const api_evs_t *evs) {
+  return evs->nseq;
+}
+
+/* Private state of each evaluation worker */
+typedef struct evs_wrk_s {
+  api_evs_t  *evs;
+  mdl_t      *mdl;
+  api_ctx_t  *ctx;
+  uint64_t   *cnt;        // [3][Y]
+  uint64_t    tokerr, seqerr;
+} evs_wrk_t;
+
+static void evs_worker(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  evs_wrk_t *wrk = ud;
+  api_evs_t *evs = wrk->evs;
+  const uint32_t Y = evs->nlbl;
+  uint64_t *tp = wrk->cnt, *fp = tp + Y, *fn = fp + Y;
+  uint32_t n, pos;
+  unused(id);
+  unused(cnt);
+  while (mth_getjob(job, &n, &pos)) {
+    for (uint32_t s = pos; s < pos + n; s++) {
+      const seq_t *seq = evs->seq[s];
+      ctx_loadseq(wrk->ctx, seq);
+      ctx_viterbi(wrk->mdl, wrk->ctx);
+      const uint32_t *out = wrk->ctx->out;
+      bool err = false;
+      for (uint32_t t = 0; t < seq->len; t++) {
+        const uint32_t ref = seq->pos[t].lbl;
+        if (out[t] == ref) {
+          tp[ref]++;
+          continue;
+        }
+        err = true;
+        wrk->tokerr++;
+        fp[out[t]]++;
+        if (ref != evs_none)
+          fn[ref]++;
+      }
+      wrk->seqerr += err;
+      memcpy(evs->out + evs->off[s], out, sizeof(uint32_t) * seq->len);
+    }
+  }
+}
+
+/*
+ * Labels the whole set with the model and stores its scores in res.
+ * The model must have the dictionaries the set was compiled with, its
+ * weights can be anything. Labels found are kept in the set until the
+ * next evaluation, see api_eval_labels and api_eval_label.
+ */
+void api_eval(mdl_t *mdl, api_evs_t *evs, api_eval_t *res) {
+  if (mdl->nobs != evs->nobs || mdl->nlbl != evs->nlbl)
+    fatal("model does not match the evaluation set");
+  const uint32_t S = evs->nseq, Y = evs->nlbl;
+  const uint32_t W = max(min(mdl->opt->nthread, S), 1u);
+  if (evs->out == NULL)
+    evs->out = xmalloc(sizeof(uint32_t) * (evs->off[S] + 1));
+  if (evs->nwctx < W) {
+    evs->wctx = xrealloc(evs->wctx, sizeof(api_ctx_t *) * W);
+    for (uint32_t w = evs->nwctx; w < W; w++)
+      evs->wctx[w] = api_new_ctx();
+    evs->nwctx = W;
+  }
+
+  evs_wrk_t *wrks = xmalloc(sizeof(evs_wrk_t) * W);
+  void **uds = xmalloc(sizeof(void *) * W);
+  for (uint32_t w = 0; w < W; w++) {
+    wrks[w].evs = evs;
+    wrks[w].mdl = mdl;
+    wrks[w].ctx = evs->wctx[w];
+    wrks[w].cnt = xmalloc(sizeof(uint64_t) * 3 * (Y + 1));
+    memset(wrks[w].cnt, 0, sizeof(uint64_t) * 3 * (Y + 1));
+    wrks[w].tokerr = wrks[w].seqerr = 0;
+    uds[w] = &wrks[w];
+  }
+  mth_spawn(evs_worker, W, uds, S, mdl->opt->jobsize);
+
+  memset(res, 0, sizeof(api_eval_t));
+  memset(evs->cnt, 0, sizeof(uint64_t) * 3 * (Y + 1));
+  for (uint32_t w = 0; w < W; w++) {
+    for (uint32_t i = 0; i < 3 * Y; i++)
+      evs->cnt[i] += wrks[w].cnt[i];
+    res->tokerr += wrks[w].tokerr;
+    res->seqerr += wrks[w].seqerr;
+    free(wrks[w].cnt);
+  }
+  free(uds);
+  free(wrks);
+
+  res->seqs = S;
+  res->toks = evs->off[S];
+  res->acc = res->toks != 0 ? 1.0 - (double)res->tokerr / res->toks : 1.0;
+  uint32_t nf = 0;
+  for (uint32_t y = 0; y < Y; y++) {
+    const uint64_t *c = evs->cnt;
+    if (c[y] + c[Y + y] + c[2 * Y + y] == 0)
+      continue;
+    res->f1 += api_eval_label(evs, y, NULL, NULL);
+    nf++;
+  }
+  if (nf != 0)
+    res->f1 /= nf;
+}
+
+/*
+ * Returns the F1 score of a label in the last evaluation, and stores
+ * its precision and recall in prec and rec if not NULL.
+ */
+double api_eval_label(const api_evs_t *evs, uint32_t lbl, double *prec,
+                      double *rec) {
+  const uint32_t Y = evs->nlbl;
+  if (lbl >= Y)
+    fatal("invalid label id %"PRIu32, lbl);
+  const uint64_t tp = evs->cnt[lbl];
+  const uint64_t fp = evs->cnt[Y + lbl];
+  const uint64_t fn = evs->cnt[2 * Y + lbl];
+  const double p = tp + fp != 0 ? (double)tp / (tp + fp) : 0.0;
+  const double r = tp + fn != 0 ? (double)tp / (tp + fn) : 0.0;
+  if (prec != NULL)
+    *prec = p;
+  if (rec != NULL)
+    *rec = r;
+  return p + r != 0.0 ? 2.0 * p * r / (p + r) : 0.0;
+}
+
+/*
+ * Returns the labels found for the s-th sequence of the set in the last
+ * evaluation, and stores its length in len.
+ */
+const uint32_t *api_eval_labels(const api_evs_t *evs, uint32_t s,
+                                uint32_t *len) {
+  if (s >= evs->nseq || evs->out == NULL)
+    return NULL;
+  *len = evs->seq[s]->len;
+  return evs->out + evs->off[s];
+}
@@ -0,0 +1,277 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "quark.h"
+#include "reader.h"
+#include "sequence.h"
+#include "tools.h"
+#include "vmath.h"
+#include "api.h"
+#include "dict.h"
+#include "mdlext.h"
+
+/*
+ * Feature space bounds
+ *
+ * Rich patterns generate observations by the tens of millions, most of
+ * them seen once, and theta holds a block of weights for each. Two ways
+ * to keep this in check:
+ *
+ *   - a frequency cutoff, applied to the training data by ext_sync just
+ *     before mdl_sync sizes the model. New observations seen fewer than
+ *     k times in it are dropped from the dictionary and the sequences.
+ *     Observations the model already has weights for are always kept.
+ *     In distributed training, the counts are those of all the nodes.
+ *
+ *   - hashed features, where observation strings are never stored, but
+ *     hashed into 2^b buckets per observation kind. The buckets stand
+ *     for the observations of the model, the ones of each kind used by
+ *     the patterns after the previous kind, so their layout follows
+ *     from b and the patterns alone. The dictionary stays empty, the
+ *     model is sized by fsp_sync instead of mdl_sync, and model files
+ *     hold a single "#hash#b" observation in its place. All the buckets
+ *     keep their weights, so a model holds at most 3 * 2^b blocks of
+ *     them, zero or not, whatever the data.
+ */
+
+/* Returned for strings of an unknown kind, like qrk_str2id */
+static const uint64_t fsp_none = (uint64_t)-1;
+
+static int fsp_kind(char c) {
+  switch (c) {
+    case 'u': return 0;
+    case 'b': return 1;
+    case '*': return 2;
+  }
+  return -1;
+}
+
+/*
+ * Sets the number of times a new observation must appear in the
+ * training data to get into the model at the next training. 0 or 1
+ * keeps them all.
+ */
+void api_set_cutoff(mdl_t *mdl, uint32_t k) {
+  mdl_ext(mdl)->cutoff = k;
+}
+
+/* Lays the buckets out for the kinds of the patterns, one after another */
+static void fsp_layout(mdl_t *mdl, uint32_t bits) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  const rdr_t *rdr = mdl->reader;
+  bool used[3] = {false, false, false};
+  for (uint32_t p = 0; p < rdr->npats; p++) {
+    const int k = fsp_kind(rdr->pats[p]->src[0]);
+    if (k >= 0)
+      used[k] = true;
+  }
+  const uint64_t B = (uint64_t)1 << bits;
+  uint64_t O = 0;
+  for (int k = 0; k < 3; k++) {
+    ext->hoff[k] = fsp_none;
+    if (!used[k])
+      continue;
+    ext->hoff[k] = O;
+    O += B;
+  }
+  ext->hbits = bits;
+}
+
+/*
+ * Switches the model to hashed features in 2^bits buckets per kind of
+ * pattern, which must have been loaded already. It can only be done
+ * before any training data is added, and is kept by the model files.
+ */
+void api_set_hashing(mdl_t *mdl, uint32_t bits) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  rdr_t *rdr = mdl->reader;
+  if (bits == 0 || bits > 32)
+    fatal("hashing needs 1 to 32 bits");
+  if (rdr->npats == 0)
+    fatal("hashing needs patterns");
+  if (qrk_count(rdr->obs) != 0 || mdl->nobs != 0 || ext->hbits != 0)
+    fatal("hashing must be set on a new model");
+  fsp_layout(mdl, bits);
+}
+
+/* Maps an observation to its bucket, the model is hashed */
+uint64_t fsp_obs2id(mdl_t *mdl, const char *str) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  const int k = fsp_kind(str[0]);
+  if (k < 0 || ext->hoff[k] == fsp_none)
+    return fsp_none;
+  const uint64_t mask = ((uint64_t)1 << ext->hbits) - 1;
+  return ext->hoff[k] + (fdc_hash(str) & mask);
+}
+
+/* Returns the number of buckets of a hashed model */
+uint64_t fsp_count(mdl_t *mdl) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  uint64_t O = 0;
+  for (int k = 0; k < 3; k++)
+    if (ext->hoff[k] != fsp_none)
+      O += (uint64_t)1 << ext->hbits;
+  return O;
+}
+
+/*
+ * Sizes the model for its labels and observations like mdl_sync, which
+ * it is used for unless the model is hashed. The buckets get the same
+ * blocks mdl_sync would give observations of their kind, in order, but
+ * without strings to read it from. As with mdl_sync, a change in the
+ * labels starts over from zero weights.
+ */
+void fsp_sync(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->hbits == 0) {
+    mdl_sync(mdl);
+    return;
+  }
+  const uint64_t Y = qrk_count(mdl->reader->lbl);
+  const uint64_t O = fsp_count(mdl), B = (uint64_t)1 << ext->hbits;
+  if (mdl->nlbl == Y && mdl->nobs == O)
+    return;
+  if (Y == 0)
+    fatal("cannot synchronize an empty model");
+  free(mdl->kind);
+  free(mdl->uoff);
+  free(mdl->boff);
+  if (mdl->theta != NULL)
+    xvm_free(mdl->theta);
+  mdl->kind = xmalloc(sizeof(char) * O);
+  mdl->uoff = xmalloc(sizeof(uint64_t) * O);
+  mdl->boff = xmalloc(sizeof(uint64_t) * O);
+  uint64_t F = 0;
+  for (int k = 0; k < 3; k++) {
+    if (ext->hoff[k] == fsp_none)
+      continue;
+    for (uint64_t o = ext->hoff[k]; o < ext->hoff[k] + B; o++) {
+      mdl->kind[o] = k + 1;
+      if (mdl->kind[o] & 1)
+        mdl->uoff[o] = F, F += Y;
+      if (mdl->kind[o] & 2)
+        mdl->boff[o] = F, F += Y * Y;
+    }
+  }
+  mdl->nlbl = Y;
+  mdl->nobs = O;
+  mdl->nftr = F;
+  mdl->theta = xvm_new(F);
+  for (uint64_t f = 0; f < F; f++)
+    mdl->theta[f] = 0.0;
+  qrk_lock(mdl->reader->lbl, true);
+  qrk_lock(mdl->reader->obs, true);
+}
+
+/* Writes the observation a hashed model saves instead of its dictionary */
+void fsp_tag(mdl_t *mdl, char buf[fsp_tagsz]) {
+  snprintf(buf, fsp_tagsz, "#hash#%"PRIu32, mdl_ext(mdl)->hbits);
+}
+
+/*
+ * Turns hashing back on for a model read from a file, whose patterns
+ * are already loaded, if str is the tag it saved in place of the
+ * dictionary. With patterns, observations start with their kind, so a
+ * dictionary of one observation is never taken for a tag.
+ */
+bool fsp_load(mdl_t *mdl, const char *str) {
+  uint32_t bits;
+  int len = 0;
+  if (mdl->reader->npats == 0 || sscanf(str, "#hash#%"SCNu32"%n", &bits, &len) != 1
+      || str[len] != '\0' || bits == 0 || bits > 32)
+    return false;
+  fsp_layout(mdl, bits);
+  return true;
+}
+
+/* Maps the observations of a data set, dropping the ones mapped to none */
+static void fsp_remap(dat_t *dat, const uint64_t map[], uint64_t O) {
+  if (dat == NULL)
+    return;
+  for (uint32_t s = 0; s < dat->nseq; s++) {
+    seq_t *seq = dat->seq[s];
+    for (uint32_t t = 0; t < seq->len; t++) {
+      pos_t *pos = &seq->pos[t];
+      uint32_t n = 0;
+      for (uint32_t i = 0; i < pos->ucnt; i++)
+        if (pos->uobs[i] < O || map[pos->uobs[i] - O] != fsp_none)
+          pos->uobs[n++] = pos->uobs[i] < O ? pos->uobs[i]
+                                            : map[pos->uobs[i] - O];
+      pos->ucnt = n;
+      n = 0;
+      for (uint32_t i = 0; i < pos->bcnt; i++)
+        if (pos->bobs[i] < O || map[pos->bobs[i] - O] != fsp_none)
+          pos->bobs[n++] = pos->bobs[i] < O ? pos->bobs[i]
+                                            : map[pos->bobs[i] - O];
+      pos->bcnt = n;
+    }
+  }
+}
+
+/*
+ * Drops the new observations seen fewer than cutoff times in the
+ * training data, before the model is extended to them. The observation
+ * dictionary is rebuilt without them, and the next ones move down.
+ */
+void fsp_cutoff(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  rdr_t *rdr = mdl->reader;
+  const uint64_t O = mdl->nobs, Q = qrk_count(rdr->obs);
+  if (ext->cutoff <= 1 || ext->hbits != 0 || Q == O)
+    return;
+
+  // Count the positions each new observation appears at, the ones of
+  // both kinds are in both lists but only counted once
+  const uint64_t N = Q - O;
+  uint32_t *cnt = xmalloc(sizeof(uint32_t) * N);
+  bool *both = xmalloc(sizeof(bool) * N);
+  for (uint64_t o = 0; o < N; o++) {
+    cnt[o] = 0;
+    both[o] = qrk_id2str(rdr->obs, O + o)[0] == '*';
+  }
+  const dat_t *dat = mdl->train;
+  for (uint32_t s = 0; s < dat->nseq; s++) {
+    const seq_t *seq = dat->seq[s];
+    for (uint32_t t = 0; t < seq->len; t++) {
+      const pos_t *pos = &seq->pos[t];
+      for (uint32_t i = 0; i < pos->ucnt; i++)
+        if (pos->uobs[i] >= O && cnt[pos->uobs[i] - O] != UINT32_MAX)
+          cnt[pos->uobs[i] - O]++;
+      for (uint32_t i = 0; i < pos->bcnt; i++)
+        if (pos->bobs[i] >= O && !both[pos->bobs[i] - O]
+            && cnt[pos->bobs[i] - O] != UINT32_MAX)
+          cnt[pos->bobs[i] - O]++;
+    }
+  }
+  free(both);
+  dst_count(mdl, cnt, N);
+
+  // Rebuild the dictionary with the survivors, in the same order
+  qrk_t *obs = qrk_new();
+  for (uint64_t o = 0; o < O; o++)
+    qrk_str2id(obs, qrk_id2str(rdr->obs, o));
+  uint64_t *map = xmalloc(sizeof(uint64_t) * N);
+  for (uint64_t o = 0; o < N; o++) {
+    map[o] = fsp_none;
+    if (cnt[o] >= ext->cutoff)
+      map[o] = qrk_str2id(obs, qrk_id2str(rdr->obs, O + o));
+  }
+  free(cnt);
+  info("* Cutoff: %"PRIu64" of %"PRIu64" new observations kept\n",
+       qrk_count(obs) - O, N);
+
+  fsp_remap(mdl->train, map, O);
+  fsp_remap(mdl->devel, map, O);
+  free(map);
+  qrk_lock(obs, qrk_lock(rdr->obs, false));
+  qrk_free(rdr->obs);
+  rdr->obs = obs;
+  tkc_clear(mdl);
+}
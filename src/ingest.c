@@ -0,0 +1,239 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "reader.h"
+#include "sequence.h"
+#include "tools.h"
+#include "api.h"
+#include "arena.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Streaming ingest of training data
+ *
+ * The file is read in large chunks in a single buffer and sequences are
+ * parsed in place: a labeling context splits each block of lines in
+ * spans pointing into the buffer, so no token is ever copied, and the
+ * features are built by the model pattern program. Only the final
+ * sequences, which hold observation ids, are stored, in the training
+ * arena.
+ */
+
+/* Size of the first read buffer, it doubles for longer sequences */
+#define ing_bufsz (1 << 20)
+
+/* Size of the training arena chunks */
+#define ing_arnsz (8 << 20)
+
+/*
+ * Copies a sequence in an arena, with its observation arrays right
+ * after it.
+ */
+seq_t *ext_copyseq(arn_t *arena, const seq_t *src) {
+  const uint32_t T = src->len;
+  size_t size = 0;
+  for (uint32_t t = 0; t < T; t++)
+    size += src->pos[t].ucnt + src->pos[t].bcnt;
+
+  const size_t hdr = sizeof(seq_t) + sizeof(pos_t) * T;
+  seq_t *seq = arn_alloc(arena, hdr + sizeof(uint64_t) * size);
+  seq->len = T;
+  seq->raw = (uint64_t *)((char *)seq + hdr);
+  uint64_t *tmp = seq->raw;
+  for (uint32_t t = 0; t < T; t++) {
+    const pos_t *from = &src->pos[t];
+    pos_t *pos = &seq->pos[t];
+    pos->lbl  = from->lbl;
+    pos->ucnt = from->ucnt;
+    pos->uobs = tmp;
+    memcpy(tmp, from->uobs, sizeof(uint64_t) * from->ucnt);
+    tmp += from->ucnt;
+    pos->bcnt = from->bcnt;
+    pos->bobs = tmp;
+    memcpy(tmp, from->bobs, sizeof(uint64_t) * from->bcnt);
+    tmp += from->bcnt;
+  }
+  return seq;
+}
+
+/*
+ * Copies a sequence to the training data. Sequences and their
+ * observation arrays are laid out back to back in the training arena,
+ * in the order they are added, ext_schedule reorders them for the
+ * trainers. The sequences array grows geometrically so adding many
+ * sequences stays linear.
+ */
+void ext_addseq(mdl_t *mdl, const seq_t *src) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  dat_t *dat = mdl->train;
+  if (ext->arena == NULL)
+    ext->arena = arn_new(ing_arnsz);
+  seq_t *seq = ext_copyseq(ext->arena, src);
+
+  if (dat->nseq >= ext->trnsz) {
+    ext->trnsz = max(ext->trnsz * 2, (size_t)64);
+    dat->seq = xrealloc(dat->seq, sizeof(seq_t *) * ext->trnsz);
+  }
+  dat->seq[dat->nseq++] = seq;
+  dat->mlen = max(dat->mlen, seq->len);
+}
+
+/*
+ * Orders the training sequences by decreasing length, just before
+ * training. Gradient workers take them in batches of opt->jobsize as
+ * they become free, so the longest ones are spread over all workers
+ * first, and the short ones left at the end even out the load instead
+ * of a few long ones holding up a single worker. The counting sort
+ * over the lengths is linear and keeps the order of the sequences of
+ * each length.
+ */
+void ext_schedule(mdl_t *mdl) {
+  dat_t *dat = mdl->train;
+  const uint32_t S = dat->nseq, L = dat->mlen;
+  if (S < 2)
+    return;
+  // Bucket of each length L - len, so the longest come first
+  size_t *off = xmalloc(sizeof(size_t) * ((size_t)L + 2));
+  for (size_t b = 0; b < (size_t)L + 2; b++)
+    off[b] = 0;
+  for (uint32_t s = 0; s < S; s++)
+    off[L - dat->seq[s]->len + 1]++;
+  for (size_t b = 1; b < (size_t)L + 2; b++)
+    off[b] += off[b - 1];
+  seq_t **seq = xmalloc(sizeof(seq_t *) * mdl_ext(mdl)->trnsz);
+  for (uint32_t s = 0; s < S; s++)
+    seq[off[L - dat->seq[s]->len]++] = dat->seq[s];
+  free(off);
+  free(dat->seq);
+  dat->seq = seq;
+}
+
+/*
+ * Drops all the training sequences, leaving an empty training set.
+ * Their memory goes away with the arena in one go.
+ */
+void ext_cleartrain(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  dat_t *dat = mdl->train;
+  free(dat->seq);
+  dat->seq = NULL;
+  dat->nseq = 0;
+  dat->mlen = 0;
+  ext->trnsz = 0;
+  if (ext->arena != NULL)
+    arn_free(ext->arena);
+  ext->arena = NULL;
+}
+
+/* Builds and stores the sequence of a block of lines */
+static void ing_block(mdl_t *mdl, api_ctx_t *ctx, const char *str,
+                      size_t len) {
+  ctx_split(ctx, str, len, true);
+  if (mdl->reader->npats == 0 && mdl_ext(mdl)->hbits != 0)
+    fatal("hashed models need patterns");
+  ext_addseq(mdl, ctx_raw2seq(mdl, ctx, true));
+}
+
+/*
+ * Adds the sequence held in len chars of lines, through a context like
+ * the streaming ingest, so observations go through ext_obs2id.
+ */
+void ext_addlines(mdl_t *mdl, const char *lines, size_t len) {
+  api_ctx_t *ctx = api_new_ctx();
+  ing_block(mdl, ctx, lines, len);
+  api_free_ctx(ctx);
+}
+
+/*
+ * Adds a training sequence of T positions of C columns already split by
+ * the caller, laid out like for api_label_cols with the label in the
+ * last column. ctx is only used as scratch memory.
+ */
+void api_add_train_cols(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                        uint32_t T, uint32_t C) {
+  ext_thaw(mdl);
+  const bool lock = ext_grow(mdl, false);
+  ctx_columns(ctx, cells, T, C, true);
+  ext_addseq(mdl, ctx_raw2seq(mdl, ctx, true));
+  ext_grow(mdl, lock);
+}
+
+/* Returns true if the line holds nothing but spaces */
+static bool ing_blank(const char *str, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if (!isspace((unsigned char)str[i]))
+      return false;
+  return true;
+}
+
+/*
+ * Reads BIO-formatted training data from file until its end and adds
+ * all its sequences to the model. Sequences are separated by empty or
+ * blank lines, like in wapiti's data files. Returns the number of
+ * sequences added.
+ */
+uint32_t api_add_train_stream(mdl_t *mdl, FILE *file) {
+  ext_thaw(mdl);
+  const bool lock = ext_grow(mdl, false);
+  const uint32_t first = mdl->train->nseq;
+  api_ctx_t *ctx = api_new_ctx();
+
+  // The buffer holds [beg, end) of unconsumed data. Lines before scan
+  // belong to the current sequence, none of them blank if any is set.
+  size_t size = ing_bufsz, beg = 0, scan = 0, end = 0;
+  char *buf = xmalloc(size);
+  bool any = false, eof = false;
+  while (true) {
+    char *nl = memchr(buf + scan, '\n', end - scan);
+    if (nl == NULL && !eof) {
+      // Make room for the rest of the line and read some more
+      if (beg != 0) {
+        memmove(buf, buf + beg, end - beg);
+        scan -= beg;
+        end -= beg;
+        beg = 0;
+      }
+      if (end == size) {
+        size *= 2;
+        buf = xrealloc(buf, size);
+      }
+      end += fread(buf + end, 1, size - end, file);
+      if (end != size) {
+        if (ferror(file))
+          pfatal("cannot read training data");
+        eof = true;
+      }
+      continue;
+    }
+    if (nl == NULL && scan == end) {
+      if (any)
+        ing_block(mdl, ctx, buf + beg, end - beg);
+      break;
+    }
+
+    const size_t eol = nl != NULL ? (size_t)(nl - buf) : end;
+    const size_t next = nl != NULL ? eol + 1 : end;
+    if (!ing_blank(buf + scan, eol - scan)) {
+      any = true;
+      scan = next;
+      continue;
+    }
+    if (any)
+      ing_block(mdl, ctx, buf + beg, scan - beg);
+    any = false;
+    beg = scan = next;
+  }
+
+  free(buf);
+  api_free_ctx(ctx);
+  ext_grow(mdl, lock);
+  return mdl->train->nseq - first;
+}
@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Log ring
+ *
+ * With the ring on, warning and info messages are formatted directly
+ * into a slot of a fixed ring buffer, and a background thread hands
+ * them to api_logs. Threads emitting messages never block or allocate:
+ * slots are claimed with a compare-and-swap on the head, following the
+ * bounded queue of D. Vyukov, and a message arriving when the ring is
+ * full is dropped and counted. Fatal messages bypass the ring, they
+ * are the last words of the process.
+ *
+ * The ring itself is static so that it never goes away under an
+ * emitting thread. While the ring is off, emitters only do a relaxed
+ * load of the on flag. Otherwise they are counted before they look at
+ * it again, and turning the ring off waits for the ones in flight
+ * before draining it and stopping the thread.
+ */
+typedef struct lgr_slot_s {
+  uint64_t seq;           // Position the slot is ready to be
+  int      lvl;           //   written at, or read at plus one
+  char     msg[MAXLOGMSG];
+} lgr_slot_t;
+
+static struct {
+  lgr_slot_t *slots;
+  uint64_t    mask;
+  uint64_t    head, tail;
+  uint64_t    drop;
+  uint32_t    users;
+  bool        on, stop;
+  pthread_t   thread;
+} lgr;
+
+/* Hands over the message in the next slot, returns false if none */
+static bool lgr_pop(void) {
+  lgr_slot_t *slot = &lgr.slots[lgr.tail & lgr.mask];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != lgr.tail + 1)
+    return false;
+  api_logs[slot->lvl](slot->msg);
+  __atomic_store_n(&slot->seq, lgr.tail + lgr.mask + 1, __ATOMIC_RELEASE);
+  lgr.tail++;
+  return true;
+}
+
+static void *lgr_run(void *ud) {
+  unused(ud);
+  const struct timespec nap = {0, 1000000};
+  for (;;) {
+    if (lgr_pop())
+      continue;
+    if (__atomic_load_n(&lgr.stop, __ATOMIC_ACQUIRE)) {
+      while (lgr_pop())
+        ;
+      return NULL;
+    }
+    nanosleep(&nap, NULL);
+  }
+}
+
+/* Stops the thread after it delivered everything queued */
+static void lgr_off(void) {
+  if (!lgr.on)
+    return;
+  __atomic_store_n(&lgr.on, false, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&lgr.users, __ATOMIC_SEQ_CST) != 0)
+    sched_yield();
+  __atomic_store_n(&lgr.stop, true, __ATOMIC_RELEASE);
+  pthread_join(lgr.thread, NULL);
+  free(lgr.slots);
+  lgr.slots = NULL;
+}
+
+/*
+ * Queues warning and info messages in a ring of size slots, rounded up
+ * to a power of 2, delivered to api_logs by a background thread. 0
+ * turns the ring off, after delivering the messages still queued, and
+ * the log functions are called directly again. Not to be called while
+ * other threads are changing the ring.
+ */
+void api_set_log_ring(uint32_t size) {
+  lgr_off();
+  if (size == 0)
+    return;
+  uint64_t cnt = 2;
+  while (cnt < size)
+    cnt *= 2;
+  lgr.slots = xmalloc(sizeof(lgr_slot_t) * cnt);
+  for (uint64_t i = 0; i < cnt; i++)
+    lgr.slots[i].seq = i;
+  lgr.mask = cnt - 1;
+  lgr.head = lgr.tail = 0;
+  lgr.stop = false;
+  if (pthread_create(&lgr.thread, NULL, lgr_run, NULL) != 0)
+    fatal("cannot start log thread");
+  __atomic_store_n(&lgr.on, true, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the number of messages dropped because the ring was full */
+uint64_t api_log_dropped(void) {
+  return __atomic_load_n(&lgr.drop, __ATOMIC_RELAXED);
+}
+
+/*
+ * Formats a message into the ring. Returns false if the ring is off,
+ * the caller must then deliver the message itself.
+ */
+bool lgr_push(int lvl, const char *fmt, va_list args) {
+  // Leave the shared counter alone unless the ring may be on
+  if (!__atomic_load_n(&lgr.on, __ATOMIC_RELAXED))
+    return false;
+  __atomic_add_fetch(&lgr.users, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&lgr.on, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&lgr.users, 1, __ATOMIC_SEQ_CST);
+    return false;
+  }
+  uint64_t pos = __atomic_load_n(&lgr.head, __ATOMIC_RELAXED);
+  lgr_slot_t *slot;
+  for (;;) {
+    slot = &lgr.slots[pos & lgr.mask];
+    const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const int64_t dif = (int64_t)(seq - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&lgr.head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (dif < 0) {
+      __atomic_add_fetch(&lgr.drop, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&lgr.users, 1, __ATOMIC_SEQ_CST);
+      return true;
+    } else {
+      pos = __atomic_load_n(&lgr.head, __ATOMIC_RELAXED);
+    }
+  }
+  vsnprintf(slot->msg, MAXLOGMSG, fmt, args);
+  slot->lvl = lvl;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&lgr.users, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "model.h"
+#include "quark.h"
+#include "tools.h"
+#include "vmath.h"
+#include "api.h"
+#include "dict.h"
+#include "program.h"
+#include "mdlext.h"
+
+/*
+ * Observation lookups for the labeling path. Frozen models use their
+ * hash table, models loaded from a binary file the mapped table, and
+ * all others the reader quark, which is only read as long as it is
+ * locked.
+ */
+uint64_t ext_obs2id(mdl_t *mdl, const char *str) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->hbits != 0)
+    return fsp_obs2id(mdl, str);
+  if (ext->frz != NULL)
+    return fdc_str2id(ext->frz, str);
+  if (ext->map != NULL)
+    return dct_str2id(&ext->obs, str);
+  return qrk_str2id(mdl->reader->obs, str);
+}
+
+const char *ext_id2obs(mdl_t *mdl, uint64_t id) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->frz != NULL)
+    return ext->frz->strs[id];
+  if (ext->map != NULL)
+    return dct_id2str(&ext->obs, id);
+  return qrk_id2str(mdl->reader->obs, id);
+}
+
+/*
+ * Compiles the observations into a frozen dictionary used for all
+ * lookups at labeling time. The model must not be used by other
+ * threads while it is frozen, but can be shared freely afterwards.
+ * Changing the model observations, by training or compacting it,
+ * drops the frozen dictionary.
+ */
+void api_freeze_model(mdl_t *mdl) {
+  ext_freeze(mdl, NULL);
+}
+
+/*
+ * Freezes the model like api_freeze_model. With a pool, strings are
+ * taken from it instead of copied, and the observation quark is
+ * emptied, so models sharing the pool store their common observations
+ * only once. The quark is filled again when the model is unfrozen.
+ */
+void ext_freeze(mdl_t *mdl, spl_t *pool) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  ext_unfreeze(mdl);
+  // Hashed models have no dictionary to freeze
+  if (ext->hbits != 0)
+    return;
+  const uint64_t O = mdl->nobs;
+  const char **strs = xmalloc(sizeof(char *) * (O + 1));
+  if (pool == NULL) {
+    for (uint64_t o = 0; o < O; o++)
+      strs[o] = ext_id2obs(mdl, o);
+    ext->frz = fdc_new(strs, O);
+    free(strs);
+    return;
+  }
+  for (uint64_t o = 0; o < O; o++)
+    strs[o] = spl_get(pool, ext_id2obs(mdl, o));
+  ext->frz = fdc_share(strs, O);
+  ext->pool = pool;
+  if (ext->map == NULL) {
+    qrk_free(mdl->reader->obs);
+    mdl->reader->obs = qrk_new();
+    qrk_lock(mdl->reader->obs, true);
+  }
+}
+
+/* Compiles the current reader patterns in the model program */
+void ext_compile(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (ext->prg != NULL)
+    prg_free(ext->prg);
+  ext->prg = prg_new(mdl->reader);
+  tkc_clear(mdl);
+}
+
+/*
+ * Drops the frozen dictionary, if any, giving its strings back to the
+ * pool they come from. Unless refill is false, an observation quark
+ * emptied by ext_freeze is filled again first.
+ */
+static void ext_dropfrz(mdl_t *mdl, bool refill) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  fdc_t *frz = ext->frz;
+  if (frz == NULL)
+    return;
+  if (ext->pool != NULL) {
+    if (refill && ext->map == NULL) {
+      qrk_t *obs = mdl->reader->obs;
+      qrk_lock(obs, false);
+      for (uint64_t o = 0; o < frz->cnt; o++)
+        qrk_str2id(obs, frz->strs[o]);
+      qrk_lock(obs, true);
+    }
+    for (uint64_t o = 0; o < frz->cnt; o++)
+      spl_put(ext->pool, frz->strs[o]);
+    ext->pool = NULL;
+  }
+  fdc_free(frz);
+  ext->frz = NULL;
+}
+
+/* Drops the frozen dictionary, if any */
+void ext_unfreeze(mdl_t *mdl) {
+  ext_dropfrz(mdl, true);
+}
+
+/*
+ * Brings the model back to plain wapiti form, with its own double
+ * weights and a full observation quark. Needed before anything that
+ * goes through wapiti's own model code, like training or saving.
+ */
+void ext_thaw(mdl_t *mdl) {
+  tkc_clear(mdl);
+  ext_unfreeze(mdl);
+  bin_thaw(mdl);
+  cmp_expand(mdl);
+}
+
+/*
+ * Unlocks the model dictionaries, or restores their state, so training
+ * data can add labels and observations even to a loaded model. Returns
+ * whether they were locked before.
+ */
+bool ext_grow(mdl_t *mdl, bool lock) {
+  const bool old = qrk_lock(mdl->reader->obs, lock);
+  qrk_lock(mdl->reader->lbl, lock);
+  return old;
+}
+
+/*
+ * Extends the model to its dictionaries, like fsp_sync, but keeps the
+ * current weights even with new labels, where mdl_sync starts over.
+ * New labels and observations come after the old ones, so each old
+ * weight moves to the new place of its observation and labels, and
+ * everything new starts at zero.
+ */
+void ext_sync(mdl_t *mdl) {
+  dst_dict(mdl);
+  fsp_cutoff(mdl);
+  const uint32_t oY = mdl->nlbl, Y = qrk_count(mdl->reader->lbl);
+  // Pruning is set for the old labels, its transitions lists are sized
+  // for them, so new labels start over without any
+  if (oY != Y) {
+    prn_free(mdl);
+    mdl_ext(mdl)->beam = 0;
+  }
+  if (oY == 0 || oY == Y || mdl->theta == NULL) {
+    fsp_sync(mdl);
+    return;
+  }
+  const uint64_t oO = mdl->nobs;
+  char     *kind  = mdl->kind;
+  uint64_t *uoff  = mdl->uoff;
+  uint64_t *boff  = mdl->boff;
+  double   *theta = mdl->theta;
+  mdl->kind  = NULL;
+  mdl->uoff  = NULL;
+  mdl->boff  = NULL;
+  mdl->theta = NULL;
+  mdl->nlbl  = 0;
+  mdl->nobs  = 0;
+  mdl->nftr  = 0;
+  fsp_sync(mdl);
+  for (uint64_t o = 0; o < oO; o++) {
+    if (kind[o] & 1)
+      for (uint32_t y = 0; y < oY; y++)
+        mdl->theta[mdl->uoff[o] + y] = theta[uoff[o] + y];
+    if (kind[o] & 2)
+      for (uint32_t yp = 0; yp < oY; yp++)
+        for (uint32_t y = 0; y < oY; y++)
+          mdl->theta[mdl->boff[o] + (uint64_t)yp * Y + y] =
+            theta[boff[o] + (uint64_t)yp * oY + y];
+  }
+  free(kind);
+  free(uoff);
+  free(boff);
+  xvm_free(theta);
+}
+
+/* Releases everything the extension owns, before mdl_free */
+void ext_free(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  if (mdl->train != NULL)
+    ext_cleartrain(mdl);
+  ext_dropfrz(mdl, false);
+  bin_unmap(mdl);
+  cmp_free(mdl);
+  prn_free(mdl);
+  lbc_free(mdl);
+  tkc_free(mdl);
+  api_set_stats(mdl, false);
+  act_free(mdl);
+  if (ext->prg != NULL)
+    prg_free(ext->prg);
+  ext->prg = NULL;
+}
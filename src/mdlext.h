@@ -0,0 +1,195 @@
+#ifndef mdlext_h
+#define mdlext_h
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "model.h"
+#include "reader.h"
+#include "dict.h"
+#include "program.h"
+#include "arena.h"
+#include "api.h"
+
+/*
+ * Private state libwapiti keeps next to each wapiti model.
+ *
+ * api_new_model allocates this wrapper with the mdl_t as its first
+ * member, so the mdl_t pointer handed to users is also a pointer to
+ * the wrapper, and mdl_free releases both in one go. Anything owned
+ * by the extension must be released by api_free_model before that.
+ */
+typedef struct lbc_s lbc_t;
+typedef struct tkc_s tkc_t;
+typedef struct spl_s spl_t;
+typedef struct act_s act_t;
+
+typedef struct mdl_ext_s mdl_ext_t;
+struct mdl_ext_s {
+  mdl_t     mdl;       // Must stay first
+
+  // Read-only mapping of a binary model file, see binmdl.c. While it
+  // is set, the weights and observation offsets point into it and the
+  // observations are looked up in the mapped table instead of the
+  // reader quark.
+  void     *map;
+  size_t    mapsz;
+  dct_t     obs;
+
+  // Compact weights, see compact.c. When wbits is not 0, the model has
+  // no double weights and decoding uses either fw, or qw scaled by the
+  // per-block factors in wscale.
+  uint32_t  wbits;
+  float    *fw;        // [F]   float weights
+  void     *qw;        // [F]   int16_t or int8_t quantized weights
+  float    *wscale;    // [2O]  unigram and bigram scale per observation
+  double    werr;      //       largest error on a single weight
+
+  // Frozen observation dictionary, see api_freeze_model. Takes over
+  // all observation lookups while set. When its strings come from a
+  // shared pool, see ext_freeze, the observation quark is empty.
+  fdc_t    *frz;
+  spl_t    *pool;
+
+  // Compiled pattern program, see program.h. Rebuilt each time the
+  // reader patterns change.
+  prg_t    *prg;
+
+  // Training sequences storage, see ext_addseq. The sequences do not
+  // own their memory, so the training set must never be released with
+  // rdr_freedat while they are in it.
+  arn_t    *arena;
+  size_t    trnsz;     //       room in the training sequences array
+
+  // Pruned decoding, see prune.c. When eoff is set, only the
+  // transitions from yp to ey[eoff[yp]] ... ey[eoff[yp + 1] - 1] are
+  // allowed, and when beam is not 0 only that many labels are kept at
+  // each position.
+  uint32_t *eoff;      // [Y+1]
+  uint32_t *ey;        // [E]
+  uint64_t  nedge;
+  uint32_t  beam;
+
+  // Label results cache, see cache.c
+  lbc_t    *lbc;
+
+  // Observations of local patterns per token, see tokcache.c
+  tkc_t    *tkc;
+
+  // References held on the model, see registry.c. Only used for models
+  // owned by a registry, and protected by its lock.
+  uint32_t  refs;
+
+  // Background training running on the model, see async.c
+  api_trn_t *trn;
+
+  // Labeling counters, see stats.c, NULL unless enabled
+  api_stats_t *stats;
+
+  // Feature space bounds, see features.c. When hbits is not 0,
+  // observations are hashed in 2^hbits buckets per kind, the ones of
+  // kind 'u', 'b' and '*' starting at hoff[0], hoff[1] and hoff[2], and
+  // the observation dictionary stays empty.
+  uint32_t  cutoff;
+  uint32_t  hbits;
+  uint64_t  hoff[3];
+
+  // Transport of distributed training, see dist.c, NULL when the model
+  // trains alone. Not owned by the model.
+  api_dist_t *dist;
+
+  // Active-set training, see active.c. act only lives during a training
+  // with aperiod not 0.
+  uint32_t  aperiod;
+  act_t    *act;
+};
+
+static inline mdl_ext_t *mdl_ext(mdl_t *mdl) {
+  return (mdl_ext_t *)mdl;
+}
+
+void api_addpat(rdr_t *rdr, char *patstr);
+
+uint64_t ext_obs2id(mdl_t *mdl, const char *str);
+const char *ext_id2obs(mdl_t *mdl, uint64_t id);
+void ext_compile(mdl_t *mdl);
+seq_t *ext_copyseq(arn_t *arena, const seq_t *src);
+void ext_addseq(mdl_t *mdl, const seq_t *seq);
+void ext_addlines(mdl_t *mdl, const char *lines, size_t len);
+void ext_schedule(mdl_t *mdl);
+void ext_cleartrain(mdl_t *mdl);
+void ext_freeze(mdl_t *mdl, spl_t *pool);
+void ext_unfreeze(mdl_t *mdl);
+void ext_thaw(mdl_t *mdl);
+typedef void ext_trn_f(mdl_t *mdl);
+ext_trn_f *ext_trainer(mdl_t *mdl);
+void ext_trained(mdl_t *mdl);
+bool ext_grow(mdl_t *mdl, bool lock);
+void ext_sync(mdl_t *mdl);
+void ext_free(mdl_t *mdl);
+
+void trn_sgdl1par(mdl_t *mdl);
+
+#define fsp_tagsz 16
+uint64_t fsp_obs2id(mdl_t *mdl, const char *str);
+uint64_t fsp_count(mdl_t *mdl);
+void fsp_sync(mdl_t *mdl);
+void fsp_tag(mdl_t *mdl, char buf[fsp_tagsz]);
+bool fsp_load(mdl_t *mdl, const char *str);
+void fsp_cutoff(mdl_t *mdl);
+
+void dst_dict(mdl_t *mdl);
+void dst_count(mdl_t *mdl, uint32_t cnt[], uint64_t n);
+bool dst_agree(mdl_t *mdl, bool go);
+
+bool act_enter(mdl_t *mdl);
+void act_leave(mdl_t *mdl, const double g[], bool shrunk);
+void act_free(mdl_t *mdl);
+
+void txt_save(mdl_t *mdl, FILE *file);
+void txt_load(mdl_t *mdl, FILE *file);
+
+bool bin_check(FILE *file);
+void bin_load(mdl_t *mdl, const char *filename);
+void bin_thaw(mdl_t *mdl);
+void bin_unmap(mdl_t *mdl);
+
+void cmp_addblk(mdl_t *mdl, uint64_t o, bool bi, double r[]);
+void cmp_addidx(mdl_t *mdl, uint64_t o, const uint32_t idx[], uint64_t n,
+                double r[]);
+double *cmp_weights(mdl_t *mdl);
+void cmp_expand(mdl_t *mdl);
+void cmp_free(mdl_t *mdl);
+
+void prn_free(mdl_t *mdl);
+
+void lbc_clear(mdl_t *mdl);
+void lbc_free(mdl_t *mdl);
+
+void tkc_clear(mdl_t *mdl);
+void tkc_free(mdl_t *mdl);
+
+/*
+ * Whether labeling with the model is instrumented. Building with
+ * -DAPI_NOSTATS leaves the instrumentation out entirely.
+ */
+static inline bool sts_on(mdl_t *mdl) {
+#ifdef API_NOSTATS
+  (void)mdl;
+  return false;
+#else
+  return mdl_ext(mdl)->stats != NULL;
+#endif
+}
+
+#define MAXLOGMSG 1400
+
+bool lgr_push(int lvl, const char *fmt, va_list args);
+
+const char *spl_get(spl_t *pool, const char *str);
+void spl_put(spl_t *pool, const char *str);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "pattern.h"
+#include "reader.h"
+#include "tools.h"
+#include "program.h"
+
+/* Returns true if two non-literal items always give the same value */
+static bool prg_sameitem(const pat_item_t *a, const pat_item_t *b) {
+  if (a->type != b->type || a->caps != b->caps
+      || a->absolute != b->absolute || a->offset != b->offset
+      || a->column != b->column)
+    return false;
+  if (a->type == 'x')
+    return true;
+  return !strcmp(a->value, b->value);
+}
+
+/* Orders ops: atoms first by index, then literals by content */
+static int prg_opcmp(const prg_op_t *a, const prg_op_t *b) {
+  if (a->atom != b->atom)
+    return a->atom < b->atom ? -1 : 1;
+  if (a->atom != prg_lit)
+    return 0;
+  const int cmp = memcmp(a->str, b->str, min(a->len, b->len));
+  if (cmp != 0)
+    return cmp;
+  return a->len < b->len ? -1 : a->len > b->len;
+}
+
+static int prg_patcmp(const void *x, const void *y) {
+  const prg_pat_t *a = x, *b = y;
+  if (a->local != b->local)
+    return a->local ? 1 : -1;
+  for (uint32_t i = 0; i < a->nops && i < b->nops; i++) {
+    const int cmp = prg_opcmp(&a->ops[i], &b->ops[i]);
+    if (cmp != 0)
+      return cmp;
+  }
+  if (a->nops != b->nops)
+    return a->nops < b->nops ? -1 : 1;
+  return a->pat < b->pat ? -1 : 1;
+}
+
+/* Compiles all the patterns of a reader in a program */
+prg_t *prg_new(const rdr_t *rdr) {
+  prg_t *prg = xmalloc(sizeof(prg_t));
+  uint32_t nitems = 0;
+  for (uint32_t p = 0; p < rdr->npats; p++)
+    nitems += rdr->pats[p]->nitems;
+  prg->natoms = 0;
+  prg->atoms  = xmalloc(sizeof(pat_item_t) * (nitems + 1));
+  prg->npats  = rdr->npats;
+  prg->pats   = xmalloc(sizeof(prg_pat_t) * (rdr->npats + 1));
+  prg->maxops = 0;
+  prg->ncols  = 0;
+
+  for (uint32_t p = 0; p < rdr->npats; p++) {
+    const pat_t *pat = rdr->pats[p];
+    prg_pat_t *pp = &prg->pats[p];
+    pp->pat   = p;
+    pp->share = 0;
+    pp->local = true;
+    pp->nops  = pat->nitems;
+    pp->ops   = xmalloc(sizeof(prg_op_t) * (pat->nitems + 1));
+    for (uint32_t i = 0; i < pat->nitems; i++) {
+      const pat_item_t *item = &pat->items[i];
+      prg_op_t *op = &pp->ops[i];
+      if (item->type == 's') {
+        op->atom = prg_lit;
+        op->str  = item->value;
+        op->len  = strlen(item->value);
+        continue;
+      }
+      uint32_t a;
+      for (a = 0; a < prg->natoms; a++)
+        if (prg_sameitem(&prg->atoms[a], item))
+          break;
+      if (a == prg->natoms)
+        prg->atoms[prg->natoms++] = *item;
+      op->atom = a;
+      op->str  = NULL;
+      op->len  = 0;
+      if (item->absolute || item->offset != 0)
+        pp->local = false;
+    }
+    prg->maxops = max(prg->maxops, pp->nops);
+  }
+
+  // Find which atoms are needed without the local patterns, and the
+  // columns a token needs to be identified for the others
+  prg->actx = xmalloc(sizeof(bool) * (prg->natoms + 1));
+  for (uint32_t a = 0; a < prg->natoms; a++)
+    prg->actx[a] = false;
+  prg->nctx   = 0;
+  prg->nlocal = 0;
+  prg->lidx   = xmalloc(sizeof(uint32_t) * (rdr->npats + 1));
+  for (uint32_t p = 0; p < rdr->npats; p++) {
+    const prg_pat_t *pp = &prg->pats[p];
+    prg->lidx[p] = pp->local ? prg->nlocal++ : prg_lit;
+    if (!pp->local)
+      prg->nctx++;
+    for (uint32_t i = 0; i < pp->nops; i++) {
+      const prg_op_t *op = &pp->ops[i];
+      if (op->atom == prg_lit)
+        continue;
+      if (!pp->local)
+        prg->actx[op->atom] = true;
+      else
+        prg->ncols = max(prg->ncols, prg->atoms[op->atom].column + 1);
+    }
+  }
+
+  // Sort the patterns so the ones with common prefixes are adjacent
+  // and count how many ops each one can reuse.
+  qsort(prg->pats, prg->npats, sizeof(prg_pat_t), prg_patcmp);
+  for (uint32_t p = 1; p < prg->npats; p++) {
+    const prg_pat_t *prv = &prg->pats[p - 1];
+    prg_pat_t *cur = &prg->pats[p];
+    uint32_t n = 0;
+    while (n < prv->nops && n < cur->nops
+           && prg_opcmp(&prv->ops[n], &cur->ops[n]) == 0)
+      n++;
+    cur->share = n;
+  }
+  return prg;
+}
+
+void prg_free(prg_t *prg) {
+  for (uint32_t p = 0; p < prg->npats; p++)
+    free(prg->pats[p].ops);
+  free(prg->pats);
+  free(prg->atoms);
+  free(prg->actx);
+  free(prg->lidx);
+  free(prg);
+}
@@ -0,0 +1,63 @@
+#ifndef program_h
+#define program_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pattern.h"
+#include "reader.h"
+
+/*
+ * Pattern programs
+ *
+ * A program is the whole pattern list of a reader compiled together.
+ * Every distinct extraction, test or match item, an atom, appears only
+ * once in the program, so it is evaluated once per position however
+ * many patterns use it. Each pattern becomes a list of ops, either a
+ * literal or a reference to an atom.
+ *
+ * Patterns are sorted by their ops, and each one records how many
+ * leading ops it shares with the previous one. The observation string
+ * of a pattern is then built on top of the shared prefix already in
+ * the buffer, instead of from scratch.
+ *
+ * Local patterns only read the current position, so their observations
+ * only depend on the token there, see tokcache.c. They come after all
+ * the others in program order, and atoms record whether the others use
+ * them, so the program can be run for the non local patterns alone.
+ */
+typedef struct prg_op_s {
+  uint32_t     atom;     // Atom index, or prg_lit for a literal
+  uint32_t     len;      // Literal length
+  const char  *str;      // Literal string, not NUL terminated
+} prg_op_t;
+
+typedef struct prg_pat_s {
+  uint32_t     pat;      // Index of the pattern in the reader
+  uint32_t     share;    // Leading ops shared with the previous one
+  bool         local;    // Only reads the current position
+  uint32_t     nops;
+  prg_op_t    *ops;
+} prg_pat_t;
+
+typedef struct prg_s prg_t;
+struct prg_s {
+  uint32_t     natoms;
+  pat_item_t  *atoms;    // [natoms]  items, values owned by the reader
+  bool        *actx;     // [natoms]  used by a non local pattern
+  uint32_t     npats;
+  prg_pat_t   *pats;     // [npats]   in program order
+  uint32_t     maxops;
+  uint32_t     nctx;     //           non local patterns, first ones
+  uint32_t     nlocal;
+  uint32_t    *lidx;     // [npats]   rank of reader patterns among the
+                         //           local ones, or prg_lit
+  uint32_t     ncols;    //           columns read by local patterns
+};
+
+#define prg_lit ((uint32_t)-1)
+
+prg_t *prg_new(const rdr_t *rdr);
+void prg_free(prg_t *prg);
+
+#endif
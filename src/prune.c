@@ -0,0 +1,288 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "quark.h"
+#include "reader.h"
+#include "tools.h"
+#include "api.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Pruned decoding
+ *
+ * With large label sets most transitions can never be part of the best
+ * path. Pruned decoding only follows a set of allowed transitions, and
+ * optionally only the best labels of each position, its beam. Both
+ * are set on the model and used by all its labelings without
+ * posteriors. Only CRF models can be pruned, their transitions are not
+ * normalized.
+ *
+ * The transitions are kept as the list of next labels of each label,
+ * so a position only sums the bigram weights of the transitions it can
+ * actually take.
+ */
+
+/* Drops the allowed transitions, if any */
+void prn_free(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  free(ext->eoff);
+  free(ext->ey);
+  ext->eoff = NULL;
+  ext->ey = NULL;
+  ext->nedge = 0;
+}
+
+/* Builds the transitions lists from a [yp][y] matrix of allowed ones */
+static uint64_t prn_build(mdl_t *mdl, const bool allow[]) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  const uint32_t Y = mdl->nlbl;
+  prn_free(mdl);
+  ext->eoff = xmalloc(sizeof(uint32_t) * (Y + 1));
+  ext->ey = xmalloc(sizeof(uint32_t) * ((uint64_t)Y * Y + 1));
+  uint32_t e = 0;
+  for (uint32_t yp = 0; yp < Y; yp++) {
+    ext->eoff[yp] = e;
+    for (uint32_t y = 0; y < Y; y++)
+      if (allow[(uint64_t)yp * Y + y])
+        ext->ey[e++] = y;
+  }
+  ext->eoff[Y] = e;
+  ext->nedge = e;
+  return e;
+}
+
+static void prn_check(mdl_t *mdl) {
+  if (mdl->type != 2)
+    fatal("only CRF models can be pruned");
+}
+
+/*
+ * Allows only the transitions whose weight is at least thresh. The
+ * weight of a transition is the sum of its weights for bigram patterns
+ * reading nothing from the input, like the usual "b" pattern, as these
+ * apply at every position. Returns the number of allowed transitions.
+ */
+uint64_t api_prune_weights(mdl_t *mdl, double thresh) {
+  prn_check(mdl);
+  const uint32_t Y = mdl->nlbl;
+  const prg_t *prg = mdl_ext(mdl)->prg;
+  double *w = xmalloc(sizeof(double) * ((uint64_t)Y * Y + 1));
+  for (uint64_t d = 0; d < (uint64_t)Y * Y; d++)
+    w[d] = 0.0;
+
+  uint32_t cnt = 0;
+  for (uint32_t p = 0; prg != NULL && p < prg->npats; p++) {
+    const prg_pat_t *pat = &prg->pats[p];
+    char str[256];
+    size_t len = 0;
+    uint32_t i;
+    for (i = 0; i < pat->nops; i++) {
+      const prg_op_t *op = &pat->ops[i];
+      if (op->atom != prg_lit || len + op->len >= sizeof(str))
+        break;
+      memcpy(str + len, op->str, op->len);
+      len += op->len;
+    }
+    if (i != pat->nops || len == 0 || (str[0] != 'b' && str[0] != '*'))
+      continue;
+    str[len] = '\0';
+    const uint64_t o = ext_obs2id(mdl, str);
+    if (o == (uint64_t)-1 || !(mdl->kind[o] & 2))
+      continue;
+    cmp_addblk(mdl, o, true, w);
+    cnt++;
+  }
+  if (cnt == 0)
+    fatal("no constant bigram pattern to prune transitions from");
+
+  bool *allow = xmalloc(sizeof(bool) * ((uint64_t)Y * Y + 1));
+  for (uint64_t d = 0; d < (uint64_t)Y * Y; d++)
+    allow[d] = w[d] >= thresh;
+  const uint64_t res = prn_build(mdl, allow);
+  lbc_clear(mdl);
+  free(allow);
+  free(w);
+  return res;
+}
+
+/*
+ * Allows only the transitions valid in the BIO scheme: a label I-X can
+ * only follow B-X or I-X. Other labels can follow anything. Returns the
+ * number of allowed transitions.
+ */
+uint64_t api_prune_bio(mdl_t *mdl) {
+  prn_check(mdl);
+  const uint32_t Y = mdl->nlbl;
+  qrk_t *lbls = mdl->reader->lbl;
+  bool *allow = xmalloc(sizeof(bool) * ((uint64_t)Y * Y + 1));
+  for (uint32_t y = 0; y < Y; y++) {
+    const char *to = qrk_id2str(lbls, y);
+    const bool in = !strncmp(to, "I-", 2);
+    for (uint32_t yp = 0; yp < Y; yp++) {
+      const char *from = qrk_id2str(lbls, yp);
+      allow[(uint64_t)yp * Y + y] = !in
+        || ((from[0] == 'B' || from[0] == 'I') && from[1] == '-'
+            && !strcmp(from + 2, to + 2));
+    }
+  }
+  const uint64_t res = prn_build(mdl, allow);
+  lbc_clear(mdl);
+  free(allow);
+  return res;
+}
+
+/* Allows all transitions again */
+void api_prune_clear(mdl_t *mdl) {
+  prn_free(mdl);
+  lbc_clear(mdl);
+}
+
+/*
+ * Sets the beam width: only the width best labels of each position can
+ * be extended to the next one. 0 disables the beam.
+ */
+void api_set_beam(mdl_t *mdl, uint32_t width) {
+  prn_check(mdl);
+  mdl_ext(mdl)->beam = width;
+  lbc_clear(mdl);
+}
+
+static int prn_cmp(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* Keeps only the beam best scores of a position, -inf for the others */
+static void prn_beam(api_ctx_t *ctx, double cur[], uint32_t Y,
+                     uint32_t beam) {
+  if (beam == 0 || beam >= Y)
+    return;
+  double *tmp = ctx->eacc;
+  memcpy(tmp, cur, sizeof(double) * Y);
+  qsort(tmp, Y, sizeof(double), prn_cmp);
+  const double thr = tmp[beam - 1];
+  for (uint32_t y = 0; y < Y; y++)
+    if (cur[y] < thr)
+      cur[y] = -HUGE_VAL;
+}
+
+/*
+ * Adds the unigram weights of position t to sum. Labels other than the
+ * known one of forced positions get -inf, see ctx_lattice.
+ */
+static void prn_unigram(mdl_t *mdl, const api_ctx_t *ctx, const pos_t *pos,
+                        double sum[]) {
+  for (uint32_t y = 0; y < mdl->nlbl; y++)
+    sum[y] = 0.0;
+  for (uint32_t n = 0; n < pos->ucnt; n++)
+    cmp_addblk(mdl, pos->uobs[n], false, sum);
+  if (ctx->force && pos->lbl < mdl->nlbl)
+    for (uint32_t y = 0; y < mdl->nlbl; y++)
+      if (y != pos->lbl)
+        sum[y] = -HUGE_VAL;
+}
+
+/*
+ * Pruned Viterbi decoding of the context sequence, with the same
+ * results as ctx_viterbi. The lattice is built one position at a time,
+ * and only for the allowed transitions out of the labels still in the
+ * beam. Without pruning, it selects the same path with the same scores
+ * as the full decoder.
+ *
+ * Returns false if pruning left no path through the sequence.
+ */
+bool prn_viterbi(mdl_t *mdl, api_ctx_t *ctx) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  const seq_t *seq = ctx->seq;
+  const uint32_t Y = mdl->nlbl;
+  const uint32_t T = seq->len;
+  const uint64_t E = ext->eoff != NULL ? ext->nedge : (uint64_t)Y * Y;
+
+  const size_t EY = max(E, (uint64_t)Y) + 1;
+  size_t ysz = ctx->ysz, esz = ctx->esz, easz = ctx->esz;
+  ctx->back = ctx_grow(ctx->back, &ctx->backsz, (size_t)T * Y,
+                       sizeof(uint32_t));
+  ctx->psi  = ctx_grow(ctx->psi, &ctx->psisz, (size_t)T * Y,
+                       sizeof(double));
+  ctx->cur  = ctx_grow(ctx->cur, &ysz, Y, sizeof(double));
+  ctx->old  = ctx_grow(ctx->old, &ctx->ysz, Y, sizeof(double));
+  ctx->sum  = ctx_grow(ctx->sum, &ctx->sumsz, Y, sizeof(double));
+  ctx->eidx = ctx_grow(ctx->eidx, &esz, EY, sizeof(uint32_t));
+  ctx->eacc = ctx_grow(ctx->eacc, &easz, EY, sizeof(double));
+  ctx->esrc = ctx_grow(ctx->esrc, &ctx->esz, EY, sizeof(uint32_t));
+  uint32_t (*back)[Y] = (void *)ctx->back;
+  double   (*esc)[Y]  = (void *)ctx->psi;
+  double   *cur = ctx->cur, *old = ctx->old, *sum = ctx->sum;
+
+  prn_unigram(mdl, ctx, &seq->pos[0], sum);
+  for (uint32_t y = 0; y < Y; y++)
+    cur[y] = esc[0][y] = sum[y];
+  prn_beam(ctx, cur, Y, ext->beam);
+  for (uint32_t t = 1; t < T; t++) {
+    const pos_t *pos = &seq->pos[t];
+    for (uint32_t y = 0; y < Y; y++)
+      old[y] = cur[y];
+    prn_unigram(mdl, ctx, pos, sum);
+
+    // Collect the transitions out of the labels in the beam and sum
+    // their bigram weights
+    uint64_t K = 0;
+    for (uint32_t yp = 0; yp < Y; yp++) {
+      if (old[yp] == -HUGE_VAL)
+        continue;
+      const uint32_t e0 = ext->eoff != NULL ? ext->eoff[yp] : 0;
+      const uint32_t e1 = ext->eoff != NULL ? ext->eoff[yp + 1] : Y;
+      for (uint32_t e = e0; e < e1; e++) {
+        const uint32_t y = ext->eoff != NULL ? ext->ey[e] : e;
+        ctx->eidx[K] = yp * Y + y;
+        ctx->esrc[K] = yp;
+        K++;
+      }
+    }
+    for (uint64_t k = 0; k < K; k++)
+      ctx->eacc[k] = 0.0;
+    for (uint32_t n = 0; n < pos->bcnt; n++)
+      cmp_addidx(mdl, pos->bobs[n], ctx->eidx, K, ctx->eacc);
+
+    // Keep the best transition into each label, the first one in case
+    // of ties like the full decoder
+    for (uint32_t y = 0; y < Y; y++) {
+      cur[y] = -HUGE_VAL;
+      back[t][y] = 0;
+      esc[t][y] = 0.0;
+    }
+    bool any = false;
+    for (uint64_t k = 0; k < K; k++) {
+      const uint32_t yp = ctx->esrc[k], y = ctx->eidx[k] - yp * Y;
+      const double psi = sum[y] + ctx->eacc[k];
+      const double val = old[yp] + psi;
+      if (val > cur[y]) {
+        cur[y] = val;
+        back[t][y] = yp;
+        esc[t][y] = psi;
+        any = true;
+      }
+    }
+    if (!any)
+      return false;
+    prn_beam(ctx, cur, Y, ext->beam);
+  }
+
+  uint32_t bst = 0;
+  for (uint32_t y = 1; y < Y; y++)
+    if (cur[y] > cur[bst])
+      bst = y;
+  ctx->sc = cur[bst];
+  for (uint32_t t = T; t > 0; t--) {
+    ctx->out[t - 1] = bst;
+    ctx->psc[t - 1] = esc[t - 1][bst];
+    bst = (t != 1) ? back[t - 1][bst] : 0;
+  }
+  return true;
+}
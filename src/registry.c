@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "dict.h"
+#include "mdlext.h"
+
+/*
+ * Model registry
+ *
+ * A registry serves a set of models by name. Labeling threads acquire
+ * the current model of a name, use it, and release it. Loading a model
+ * under a name already in use swaps the new one in as a whole: threads
+ * that acquire it afterwards get the new model, while the ones still
+ * holding the old one finish with it, and it is freed with the last
+ * release.
+ *
+ * Registry models are frozen when they are added, so they are only
+ * ever read. A registry can share the storage of their observations:
+ * the frozen dictionaries then point into a pool of reference counted
+ * strings, and strings common to several models, or to the old and
+ * new versions of one, are stored once.
+ */
+
+/* String pool, each string is stored once with the count of its users */
+typedef struct spl_ent_s spl_ent_t;
+struct spl_ent_s {
+  spl_ent_t *next;        // Next entry in the same bucket
+  uint64_t   hash;
+  uint64_t   refs;
+  char       str[];
+};
+
+struct spl_s {
+  pthread_mutex_t lock;
+  uint64_t        cnt, mask;
+  spl_ent_t     **tbl;
+};
+
+typedef struct reg_slot_s {
+  char      *name;
+  mdl_t     *mdl;
+} reg_slot_t;
+
+struct api_reg_s {
+  pthread_mutex_t lock;
+  uint32_t        cnt, size;
+  reg_slot_t     *slots;
+  spl_t          *pool;   // NULL unless dictionaries are shared
+};
+
+static spl_t *spl_new(void) {
+  spl_t *pool = xmalloc(sizeof(spl_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->cnt = 0;
+  pool->mask = 1023;
+  pool->tbl = xmalloc(sizeof(spl_ent_t *) * (pool->mask + 1));
+  memset(pool->tbl, 0, sizeof(spl_ent_t *) * (pool->mask + 1));
+  return pool;
+}
+
+static void spl_free(spl_t *pool) {
+  for (uint64_t b = 0; b <= pool->mask; b++) {
+    spl_ent_t *ent = pool->tbl[b];
+    while (ent != NULL) {
+      spl_ent_t *next = ent->next;
+      free(ent);
+      ent = next;
+    }
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->tbl);
+  free(pool);
+}
+
+/* Doubles the number of buckets, keeping them at most one per string */
+static void spl_grow(spl_t *pool) {
+  const uint64_t mask = pool->mask * 2 + 1;
+  spl_ent_t **tbl = xmalloc(sizeof(spl_ent_t *) * (mask + 1));
+  memset(tbl, 0, sizeof(spl_ent_t *) * (mask + 1));
+  for (uint64_t b = 0; b <= pool->mask; b++) {
+    spl_ent_t *ent = pool->tbl[b];
+    while (ent != NULL) {
+      spl_ent_t *next = ent->next;
+      ent->next = tbl[ent->hash & mask];
+      tbl[ent->hash & mask] = ent;
+      ent = next;
+    }
+  }
+  free(pool->tbl);
+  pool->tbl = tbl;
+  pool->mask = mask;
+}
+
+/* Returns the pool copy of a string, adding it if needed */
+const char *spl_get(spl_t *pool, const char *str) {
+  const uint64_t h = fdc_hash(str);
+  pthread_mutex_lock(&pool->lock);
+  spl_ent_t *ent = pool->tbl[h & pool->mask];
+  while (ent != NULL && (ent->hash != h || strcmp(ent->str, str)))
+    ent = ent->next;
+  if (ent == NULL) {
+    if (pool->cnt > pool->mask)
+      spl_grow(pool);
+    const size_t len = strlen(str);
+    ent = xmalloc(sizeof(spl_ent_t) + len + 1);
+    memcpy(ent->str, str, len + 1);
+    ent->hash = h;
+    ent->refs = 0;
+    ent->next = pool->tbl[h & pool->mask];
+    pool->tbl[h & pool->mask] = ent;
+    pool->cnt++;
+  }
+  ent->refs++;
+  pthread_mutex_unlock(&pool->lock);
+  return ent->str;
+}
+
+/* Gives back a string returned by spl_get */
+void spl_put(spl_t *pool, const char *str) {
+  spl_ent_t *ent = (spl_ent_t *)(str - offsetof(spl_ent_t, str));
+  pthread_mutex_lock(&pool->lock);
+  if (--ent->refs == 0) {
+    spl_ent_t **ref = &pool->tbl[ent->hash & pool->mask];
+    while (*ref != ent)
+      ref = &(*ref)->next;
+    *ref = ent->next;
+    pool->cnt--;
+    free(ent);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Returns a new empty registry. If share is set, the observations of
+ * its models are stored in a common pool.
+ */
+api_reg_t *api_new_registry(bool share) {
+  api_reg_t *reg = xmalloc(sizeof(api_reg_t));
+  pthread_mutex_init(&reg->lock, NULL);
+  reg->cnt = 0;
+  reg->size = 0;
+  reg->slots = NULL;
+  reg->pool = share ? spl_new() : NULL;
+  return reg;
+}
+
+/* Drops a reference to a model, the caller holds the registry lock */
+static bool reg_unref(mdl_t *mdl) {
+  return --mdl_ext(mdl)->refs == 0;
+}
+
+/*
+ * Frees the registry and its models. Every model acquired from it must
+ * have been released before.
+ */
+void api_free_registry(api_reg_t *reg) {
+  for (uint32_t i = 0; i < reg->cnt; i++) {
+    if (reg_unref(reg->slots[i].mdl))
+      api_free_model(reg->slots[i].mdl);
+    free(reg->slots[i].name);
+  }
+  free(reg->slots);
+  if (reg->pool != NULL)
+    spl_free(reg->pool);
+  pthread_mutex_destroy(&reg->lock);
+  free(reg);
+}
+
+/* Returns the slot of a name, or NULL. The caller holds the lock. */
+static reg_slot_t *reg_find(api_reg_t *reg, const char *name) {
+  for (uint32_t i = 0; i < reg->cnt; i++)
+    if (!strcmp(reg->slots[i].name, name))
+      return &reg->slots[i];
+  return NULL;
+}
+
+/*
+ * Adds a model to the registry under a name, replacing the model
+ * previously registered under it, if any. The registry takes the model
+ * over and freezes it, it must not be used directly afterwards. The
+ * options of the model must stay valid until it is freed.
+ */
+void api_registry_add(api_reg_t *reg, const char *name, mdl_t *mdl) {
+  ext_freeze(mdl, reg->pool);
+  mdl_ext(mdl)->refs = 1;
+  mdl_t *old = NULL;
+  pthread_mutex_lock(&reg->lock);
+  reg_slot_t *slot = reg_find(reg, name);
+  if (slot == NULL) {
+    if (reg->cnt == reg->size) {
+      reg->size = max(reg->size * 2, 8u);
+      reg->slots = xrealloc(reg->slots, sizeof(reg_slot_t) * reg->size);
+    }
+    slot = &reg->slots[reg->cnt++];
+    slot->name = xstrdup(name);
+    slot->mdl = NULL;
+  }
+  if (slot->mdl != NULL && reg_unref(slot->mdl))
+    old = slot->mdl;
+  slot->mdl = mdl;
+  pthread_mutex_unlock(&reg->lock);
+  if (old != NULL)
+    api_free_model(old);
+}
+
+/*
+ * Loads a model file, as api_load_model, and adds it to the registry
+ * under a name. The swap only happens once the new model is ready, so
+ * labeling with the previous one is never interrupted, as long as
+ * binary files are replaced by renaming a new file over them, never
+ * rewritten in place, see bin_load.
+ */
+void api_registry_load(api_reg_t *reg, const char *name, char *filename,
+                       opt_t *options) {
+  api_registry_add(reg, name, api_load_model(filename, options));
+}
+
+/*
+ * Removes a name from the registry. Its model is freed once released
+ * by all its users. Returns false if the name was not registered.
+ */
+bool api_registry_remove(api_reg_t *reg, const char *name) {
+  mdl_t *old = NULL;
+  pthread_mutex_lock(&reg->lock);
+  reg_slot_t *slot = reg_find(reg, name);
+  if (slot == NULL) {
+    pthread_mutex_unlock(&reg->lock);
+    return false;
+  }
+  if (reg_unref(slot->mdl))
+    old = slot->mdl;
+  free(slot->name);
+  *slot = reg->slots[--reg->cnt];
+  pthread_mutex_unlock(&reg->lock);
+  if (old != NULL)
+    api_free_model(old);
+  return true;
+}
+
+/*
+ * Returns the current model of a name, or NULL if it is not
+ * registered. The model stays valid, even if replaced or removed,
+ * until given back with api_registry_release.
+ */
+mdl_t *api_registry_acquire(api_reg_t *reg, const char *name) {
+  pthread_mutex_lock(&reg->lock);
+  reg_slot_t *slot = reg_find(reg, name);
+  mdl_t *mdl = slot != NULL ? slot->mdl : NULL;
+  if (mdl != NULL)
+    mdl_ext(mdl)->refs++;
+  pthread_mutex_unlock(&reg->lock);
+  return mdl;
+}
+
+/* Gives back a model returned by api_registry_acquire */
+void api_registry_release(api_reg_t *reg, mdl_t *mdl) {
+  pthread_mutex_lock(&reg->lock);
+  const bool last = reg_unref(mdl);
+  pthread_mutex_unlock(&reg->lock);
+  if (last)
+    api_free_model(mdl);
+}
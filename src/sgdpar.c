@@ -0,0 +1,281 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "sequence.h"
+#include "gradient.h"
+#include "progress.h"
+#include "thread.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Parallel SGD with cumulative L1 penalty
+ *
+ * This is wapiti's sgd-l1 trainer, the method of [1], run by
+ * opt->nthread workers at once in the manner of Hogwild [2]. Each
+ * iteration the sequences are shuffled and the permutation is cut in
+ * one shard per worker. Workers compute the gradient of one sequence at
+ * a time in a private buffer and apply it straight to the shared
+ * weights, without any lock: sequences are sparse, so two workers
+ * seldom touch the same weights, and a lost update now and then does
+ * not hurt convergence.
+ *
+ * The learning rate follows the schedule of the sequential trainer, it
+ * only depends on the epoch so the same eta0 and alpha give the same
+ * steps. The total penalty u a weight should have received grows by
+ * the same amount after each sequence, so it is derived from the one
+ * at the start of the epoch and a counter of the sequences processed
+ * in it by all the workers, the only thing they share. The penalty
+ * actually applied to each weight is kept in q, like the weights
+ * themselves it is updated with relaxed atomic loads and stores only.
+ *
+ * Each worker holds a gradient buffer as large as the model.
+ *
+ *   [1] Stochastic gradient descent training for L1-regularized
+ *       log-linear models with cumulative penalty, Yoshimasa Tsuruoka
+ *       and Jun'ichi Tsuji and Sophia Ananiadou, in Proceedings of the
+ *       ACL and the 4th IJCNLP of the AFNLP, pages 477-485, 2009
+ *   [2] Hogwild!: A lock-free approach to parallelizing stochastic
+ *       gradient descent, Feng Niu, Benjamin Recht, Christopher Ré and
+ *       Stephen J. Wright, in NIPS 24, pages 693-701, 2011
+ */
+
+/* Unigram and bigram observations active in each sequence */
+typedef struct sgp_idx_s {
+  uint64_t *obs;          // ucnt unigram then bcnt bigram observations
+  uint32_t  ucnt, bcnt;
+} sgp_idx_t;
+
+/* State shared by all workers */
+typedef struct sgp_s {
+  mdl_t      *mdl;
+  sgp_idx_t  *idx;        // [S]
+  uint32_t   *perm;       // [S]  current order of the sequences
+  double     *q;          // [F]  penalty applied to each weight
+  uint32_t    epoch;      //      current iteration
+  double      u0;         //      total penalty at the start of the epoch
+  uint64_t    done;       //      sequences processed in the epoch
+  uint32_t    W;
+} sgp_t;
+
+/* And the private part of each worker */
+typedef struct sgp_wrk_s {
+  sgp_t      *sgp;
+  grd_st_t   *grd_st;
+  double     *g;          // [F]
+  uint64_t   *tmp;
+  size_t      tmpsz;
+} sgp_wrk_t;
+
+static inline double sgp_get(double *x) {
+  double v;
+  __atomic_load(x, &v, __ATOMIC_RELAXED);
+  return v;
+}
+
+static inline void sgp_set(double *x, double v) {
+  __atomic_store(x, &v, __ATOMIC_RELAXED);
+}
+
+static int sgp_cmp(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Sorts and removes duplicates from a list of observations */
+static uint32_t sgp_uniq(uint64_t obs[], uint32_t n) {
+  if (n == 0)
+    return 0;
+  qsort(obs, n, sizeof(uint64_t), sgp_cmp);
+  uint32_t m = 1;
+  for (uint32_t i = 1; i < n; i++)
+    if (obs[i] != obs[m - 1])
+      obs[m++] = obs[i];
+  return m;
+}
+
+/* Builds the index of a share of the sequences */
+static void sgp_index(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  sgp_wrk_t *wrk = ud;
+  sgp_t *sgp = wrk->sgp;
+  const dat_t *dat = sgp->mdl->train;
+  uint32_t n, pos;
+  unused(id);
+  unused(cnt);
+  while (mth_getjob(job, &n, &pos)) {
+    for (uint32_t s = pos; s < pos + n; s++) {
+      const seq_t *seq = dat->seq[s];
+      size_t N = 0;
+      for (uint32_t t = 0; t < seq->len; t++)
+        N += seq->pos[t].ucnt + seq->pos[t].bcnt;
+      if (N + 1 > wrk->tmpsz) {
+        wrk->tmpsz = N + 1;
+        wrk->tmp = xrealloc(wrk->tmp, sizeof(uint64_t) * wrk->tmpsz);
+      }
+      uint64_t *tmp = wrk->tmp;
+      uint32_t u = 0, b = 0;
+      for (uint32_t t = 0; t < seq->len; t++)
+        for (uint32_t i = 0; i < seq->pos[t].ucnt; i++)
+          tmp[u++] = seq->pos[t].uobs[i];
+      u = sgp_uniq(tmp, u);
+      for (uint32_t t = 0; t < seq->len; t++)
+        for (uint32_t i = 0; i < seq->pos[t].bcnt; i++)
+          tmp[u + b++] = seq->pos[t].bobs[i];
+      b = sgp_uniq(tmp + u, b);
+      sgp_idx_t *idx = &sgp->idx[s];
+      idx->obs = xmalloc(sizeof(uint64_t) * (u + b + 1));
+      memcpy(idx->obs, tmp, sizeof(uint64_t) * (u + b));
+      idx->ucnt = u;
+      idx->bcnt = b;
+    }
+  }
+}
+
+/*
+ * Takes a gradient step on weight f and applies what remains of its
+ * cumulative penalty, clipping at zero.
+ */
+static inline void sgp_step(double *w, double *q, double *g, uint64_t f,
+                            double nk, double u) {
+  const double z = sgp_get(&w[f]) - nk * g[f];
+  const double qf = sgp_get(&q[f]);
+  g[f] = 0.0;
+  double x = z;
+  if (z > 0.0)
+    x = max(0.0, z - (u + qf));
+  else if (z < 0.0)
+    x = min(0.0, z + (u - qf));
+  sgp_set(&w[f], x);
+  sgp_set(&q[f], qf + x - z);
+}
+
+/* Learning rate of epoch k, like sgd-l1 [1, pp 481(5)] */
+static double sgp_rate(const opt_t *opt, uint32_t k, uint32_t S) {
+  return opt->sgdl1.eta0 * pow(opt->sgdl1.alpha, (double)k / S);
+}
+
+/*
+ * Processes the shard of the current permutation of a worker. The
+ * parent sums the loss left in the gradient state.
+ */
+static void sgp_worker(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  sgp_wrk_t *wrk = ud;
+  sgp_t *sgp = wrk->sgp;
+  mdl_t *mdl = sgp->mdl;
+  const opt_t *opt = mdl->opt;
+  const uint64_t Y = mdl->nlbl;
+  const uint32_t S = mdl->train->nseq;
+  const double nk = sgp_rate(opt, sgp->epoch, S), rho1 = opt->rho1;
+  double *w = mdl->theta, *q = sgp->q, *g = wrk->g;
+  unused(job);
+  unused(cnt);
+
+  const uint32_t first = (uint64_t)S * id / sgp->W;
+  const uint32_t last = (uint64_t)S * (id + 1) / sgp->W;
+  wrk->grd_st->lloss = 0.0;
+  for (uint32_t sp = first; sp < last && !uit_stop; sp++) {
+    const uint32_t s = sgp->perm[sp];
+    grd_doseq(wrk->grd_st, mdl->train->seq[s]);
+
+    // Total penalty up to this sequence, as sgd-l1 adds nk * ρ1 / S to
+    // it after each one
+    const uint64_t i = __atomic_fetch_add(&sgp->done, 1, __ATOMIC_RELAXED);
+    const double u = sgp->u0 + (i + 1) * nk * rho1 / S;
+
+    const sgp_idx_t *idx = &sgp->idx[s];
+    for (uint32_t n = 0; n < idx->ucnt; n++) {
+      const uint64_t f = mdl->uoff[idx->obs[n]];
+      for (uint64_t y = 0; y < Y; y++)
+        sgp_step(w, q, g, f + y, nk, u);
+    }
+    for (uint32_t n = 0; n < idx->bcnt; n++) {
+      const uint64_t f = mdl->boff[idx->obs[idx->ucnt + n]];
+      for (uint64_t d = 0; d < Y * Y; d++)
+        sgp_step(w, q, g, f + d, nk, u);
+    }
+  }
+}
+
+void trn_sgdl1par(mdl_t *mdl) {
+  const uint64_t F = mdl->nftr;
+  const uint32_t S = mdl->train->nseq;
+  const uint32_t K = mdl->opt->maxiter;
+  const uint32_t W = max(min(mdl->opt->nthread, S), 1u);
+  double *w = mdl->theta;
+
+  sgp_t sgp = {mdl, NULL, NULL, NULL, 0, 0.0, 0, W};
+  sgp_wrk_t *wrks = xmalloc(sizeof(sgp_wrk_t) * W);
+  void **uds = xmalloc(sizeof(void *) * W);
+  for (uint32_t n = 0; n < W; n++) {
+    wrks[n].sgp = &sgp;
+    wrks[n].tmp = NULL;
+    wrks[n].tmpsz = 0;
+    uds[n] = &wrks[n];
+  }
+
+  info("    - Build the index\n");
+  sgp.idx = xmalloc(sizeof(sgp_idx_t) * S);
+  mth_spawn(sgp_index, W, uds, S, 64);
+  for (uint32_t n = 0; n < W; n++)
+    free(wrks[n].tmp);
+  info("      Done\n");
+
+  sgp.perm = xmalloc(sizeof(uint32_t) * S);
+  for (uint32_t s = 0; s < S; s++)
+    sgp.perm[s] = s;
+  sgp.q = xmalloc(sizeof(double) * F);
+  for (uint64_t f = 0; f < F; f++)
+    sgp.q[f] = 0.0;
+  for (uint32_t n = 0; n < W; n++) {
+    wrks[n].g = xmalloc(sizeof(double) * F);
+    for (uint64_t f = 0; f < F; f++)
+      wrks[n].g[f] = 0.0;
+    wrks[n].grd_st = grd_stnew(mdl, wrks[n].g);
+  }
+
+  for (uint32_t k = 0; k < K && !uit_stop; k++) {
+    // Shuffle the sequences with random swaps, like sgd-l1, the shards
+    // are then contiguous slices of the permutation
+    for (uint32_t s = 0; s < S; s++) {
+      const uint32_t a = rand() % S;
+      const uint32_t b = rand() % S;
+      const uint32_t t = sgp.perm[a];
+      sgp.perm[a] = sgp.perm[b];
+      sgp.perm[b] = t;
+    }
+    sgp.epoch = k;
+    sgp.done = 0;
+    mth_spawn(sgp_worker, W, uds, 0, 0);
+    if (uit_stop)
+      break;
+    sgp.u0 += sgp.done * sgp_rate(mdl->opt, k, S) * mdl->opt->rho1 / S;
+
+    // Report the loss seen over the iteration with the penalty
+    double fx = 0.0, nl1 = 0.0;
+    for (uint32_t n = 0; n < W; n++)
+      fx += wrks[n].grd_st->lloss;
+    for (uint64_t f = 0; f < F; f++)
+      nl1 += fabs(w[f]);
+    if (!uit_progress(mdl, k + 1, fx + mdl->opt->rho1 * nl1))
+      break;
+  }
+
+  for (uint32_t n = 0; n < W; n++) {
+    grd_stfree(wrks[n].grd_st);
+    free(wrks[n].g);
+  }
+  for (uint32_t s = 0; s < S; s++)
+    free(sgp.idx[s].obs);
+  free(sgp.idx);
+  free(sgp.perm);
+  free(sgp.q);
+  free(uds);
+  free(wrks);
+}
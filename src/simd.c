@@ -0,0 +1,258 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "vmath.h"
+#include "simd.h"
+
+/*
+ * Runtime dispatched vector kernels
+ *
+ * The library is linked with --wrap for the hot xvm_* functions of
+ * wapiti's vmath, so calls from the trainers land here instead. Each
+ * kernel has an AVX-512 and an AVX2 version, compiled for their target
+ * with function attributes so the rest of the build stays generic, and
+ * the best one the CPU supports is bound once when the library is
+ * loaded. Other CPUs and compilers keep wapiti's own version.
+ *
+ * Vectors may overlap only if they are the same, as in the trainers,
+ * and the reductions sum in a different order than wapiti does.
+ *
+ * The decoder kernels are dispatched the same way, with a scalar
+ * version as fallback.
+ */
+
+typedef double xvm_dot_f(const double x[], const double y[], uint64_t N);
+typedef double xvm_norm_f(const double x[], uint64_t N);
+typedef void xvm_axpy_f(double r[], double a, const double x[],
+                        const double y[], uint64_t N);
+typedef void xvm_scale_f(double r[], const double x[], double a, uint64_t N);
+typedef void xvm_sub_f(double r[], const double x[], const double y[],
+                       uint64_t N);
+typedef void xvm_neg_f(double r[], const double x[], uint64_t N);
+
+xvm_dot_f   __real_xvm_dot;
+xvm_norm_f  __real_xvm_norm;
+xvm_axpy_f  __real_xvm_axpy;
+xvm_scale_f __real_xvm_scale;
+xvm_sub_f   __real_xvm_sub;
+xvm_neg_f   __real_xvm_neg;
+
+typedef uint32_t smd_maxplus_f(const double x[], const double y[],
+                               uint32_t N, double *best);
+
+/*
+ * Returns the index of the largest x[n] + y[n], the first one in case
+ * of ties, and stores its value in best.
+ */
+static uint32_t smd_maxplus_ansi(const double x[], const double y[],
+                                 uint32_t N, double *best) {
+  double   bst = -HUGE_VAL;
+  uint32_t idx = 0;
+  for (uint32_t n = 0; n < N; n++) {
+    const double val = x[n] + y[n];
+    if (val > bst) {
+      bst = val;
+      idx = n;
+    }
+  }
+  *best = bst;
+  return idx;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(XVM_ANSI)
+
+#include <immintrin.h>
+
+#define xvm_avx2   __attribute__((target("avx2,fma")))
+#define xvm_avx512 __attribute__((target("avx512f")))
+
+/* Dot products keep two accumulators to hide the FMA latency */
+xvm_avx2 static double xvm_dot_avx2(const double x[], const double y[],
+                                    uint64_t N) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  uint64_t n = 0;
+  for ( ; n + 8 <= N; n += 8) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + n), _mm256_loadu_pd(y + n), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + n + 4),
+                         _mm256_loadu_pd(y + n + 4), s1);
+  }
+  double t[4], s;
+  _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+  s = (t[0] + t[1]) + (t[2] + t[3]);
+  for ( ; n < N; n++)
+    s += x[n] * y[n];
+  return s;
+}
+
+xvm_avx512 static double xvm_dot_avx512(const double x[], const double y[],
+                                        uint64_t N) {
+  __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+  uint64_t n = 0;
+  for ( ; n + 16 <= N; n += 16) {
+    s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + n), _mm512_loadu_pd(y + n), s0);
+    s1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + n + 8),
+                         _mm512_loadu_pd(y + n + 8), s1);
+  }
+  double s = _mm512_reduce_add_pd(_mm512_add_pd(s0, s1));
+  for ( ; n < N; n++)
+    s += x[n] * y[n];
+  return s;
+}
+
+/*
+ * Element-wise kernels are plain loops, the compiler vectorizes them
+ * for the target of each version.
+ */
+#define xvm_elemwise(isa)                                                  \
+  xvm_##isa static void xvm_axpy_##isa(double r[], double a,              \
+                                       const double x[], const double y[], \
+                                       uint64_t N) {                       \
+    for (uint64_t n = 0; n < N; n++)                                       \
+      r[n] = a * x[n] + y[n];                                              \
+  }                                                                        \
+  xvm_##isa static void xvm_scale_##isa(double r[], const double x[],     \
+                                        double a, uint64_t N) {            \
+    for (uint64_t n = 0; n < N; n++)                                       \
+      r[n] = a * x[n];                                                     \
+  }                                                                        \
+  xvm_##isa static void xvm_sub_##isa(double r[], const double x[],       \
+                                      const double y[], uint64_t N) {      \
+    for (uint64_t n = 0; n < N; n++)                                       \
+      r[n] = x[n] - y[n];                                                  \
+  }                                                                        \
+  xvm_##isa static void xvm_neg_##isa(double r[], const double x[],       \
+                                      uint64_t N) {                        \
+    for (uint64_t n = 0; n < N; n++)                                       \
+      r[n] = -x[n];                                                        \
+  }
+
+xvm_elemwise(avx2)
+xvm_elemwise(avx512)
+
+static double xvm_norm_avx2(const double x[], uint64_t N) {
+  return sqrt(xvm_dot_avx2(x, x, N));
+}
+
+static double xvm_norm_avx512(const double x[], uint64_t N) {
+  return sqrt(xvm_dot_avx512(x, x, N));
+}
+
+/*
+ * The vector versions of maxplus keep the best value and its index per
+ * lane, then pick the best lane, so they return the same index as the
+ * scalar loop.
+ */
+static uint32_t smd_maxlane(const double bst[], const double idx[],
+                            uint32_t lanes, double *best) {
+  uint32_t l = 0;
+  for (uint32_t i = 1; i < lanes; i++)
+    if (bst[i] > bst[l] || (bst[i] == bst[l] && idx[i] < idx[l]))
+      l = i;
+  *best = bst[l];
+  return idx[l];
+}
+
+xvm_avx2 static uint32_t smd_maxplus_avx2(const double x[], const double y[],
+                                          uint32_t N, double *best) {
+  __m256d bst = _mm256_set1_pd(-HUGE_VAL), idx = _mm256_setzero_pd();
+  __m256d cur = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+  const __m256d step = _mm256_set1_pd(4.0);
+  for (uint32_t n = 0; n < N; n += 4) {
+    const __m256d val = _mm256_add_pd(_mm256_loadu_pd(x + n),
+                                      _mm256_loadu_pd(y + n));
+    const __m256d gt = _mm256_cmp_pd(val, bst, _CMP_GT_OQ);
+    bst = _mm256_blendv_pd(bst, val, gt);
+    idx = _mm256_blendv_pd(idx, cur, gt);
+    cur = _mm256_add_pd(cur, step);
+  }
+  double b[4], i[4];
+  _mm256_storeu_pd(b, bst);
+  _mm256_storeu_pd(i, idx);
+  return smd_maxlane(b, i, 4, best);
+}
+
+xvm_avx512 static uint32_t smd_maxplus_avx512(const double x[],
+                                              const double y[], uint32_t N,
+                                              double *best) {
+  __m512d bst = _mm512_set1_pd(-HUGE_VAL), idx = _mm512_setzero_pd();
+  __m512d cur = _mm512_setr_pd(0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0);
+  const __m512d step = _mm512_set1_pd(8.0);
+  for (uint32_t n = 0; n < N; n += 8) {
+    const __m512d val = _mm512_add_pd(_mm512_loadu_pd(x + n),
+                                      _mm512_loadu_pd(y + n));
+    const __mmask8 gt = _mm512_cmp_pd_mask(val, bst, _CMP_GT_OQ);
+    bst = _mm512_mask_blend_pd(gt, bst, val);
+    idx = _mm512_mask_blend_pd(gt, idx, cur);
+    cur = _mm512_add_pd(cur, step);
+  }
+  double b[8], i[8];
+  _mm512_storeu_pd(b, bst);
+  _mm512_storeu_pd(i, idx);
+  return smd_maxlane(b, i, 8, best);
+}
+
+static smd_maxplus_f *smd_maxplus_resolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return smd_maxplus_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return smd_maxplus_avx2;
+  return smd_maxplus_ansi;
+}
+
+smd_maxplus_f smd_maxplus __attribute__((ifunc("smd_maxplus_resolve")));
+
+/* Returns the best version of a kernel for the running CPU */
+#define xvm_dispatch(name)                                                 \
+  static xvm_##name##_f *xvm_##name##_resolve(void) {                      \
+    __builtin_cpu_init();                                                  \
+    if (__builtin_cpu_supports("avx512f"))                                 \
+      return xvm_##name##_avx512;                                          \
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))   \
+      return xvm_##name##_avx2;                                            \
+    return __real_xvm_##name;                                              \
+  }                                                                        \
+  xvm_##name##_f __wrap_xvm_##name                                         \
+    __attribute__((ifunc("xvm_" #name "_resolve")));
+
+xvm_dispatch(dot)
+xvm_dispatch(norm)
+xvm_dispatch(axpy)
+xvm_dispatch(scale)
+xvm_dispatch(sub)
+xvm_dispatch(neg)
+
+#else
+
+uint32_t smd_maxplus(const double x[], const double y[], uint32_t N,
+                     double *best) {
+  return smd_maxplus_ansi(x, y, N, best);
+}
+
+double __wrap_xvm_dot(const double x[], const double y[], uint64_t N) {
+  return __real_xvm_dot(x, y, N);
+}
+
+double __wrap_xvm_norm(const double x[], uint64_t N) {
+  return __real_xvm_norm(x, N);
+}
+
+void __wrap_xvm_axpy(double r[], double a, const double x[],
+                     const double y[], uint64_t N) {
+  __real_xvm_axpy(r, a, x, y, N);
+}
+
+void __wrap_xvm_scale(double r[], const double x[], double a, uint64_t N) {
+  __real_xvm_scale(r, x, a, N);
+}
+
+void __wrap_xvm_sub(double r[], const double x[], const double y[],
+                    uint64_t N) {
+  __real_xvm_sub(r, x, y, N);
+}
+
+void __wrap_xvm_neg(double r[], const double x[], uint64_t N) {
+  __real_xvm_neg(r, x, N);
+}
+
+#endif
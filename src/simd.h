@@ -0,0 +1,19 @@
+#ifndef simd_h
+#define simd_h
+
+#include <stdint.h>
+
+/*
+ * Vector kernels of the labeling decoder, see simd.c. Vectors given to
+ * them are padded to a multiple of smd_pad items.
+ */
+#define smd_pad 8
+
+static inline uint32_t smd_padded(uint32_t N) {
+  return (N + smd_pad - 1) / smd_pad * smd_pad;
+}
+
+uint32_t smd_maxplus(const double x[], const double y[], uint32_t N,
+                     double *best);
+
+#endif
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Labeling instrumentation
+ *
+ * When enabled on a model, labeling goes through the versions of the
+ * pipeline below, which time each step and count what they did. The
+ * counts are added to the context that did the work, which belongs to
+ * one thread, and to the model. Model counters are only updated once
+ * per call, with relaxed atomic adds, so threads don't wait on each
+ * other. Otherwise labeling only pays for the sts_on test.
+ */
+
+static uint64_t sts_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Adds the counts of one call to the context and the model */
+static void sts_add(mdl_t *mdl, api_ctx_t *ctx, const api_stats_t *d) {
+  uint64_t *mst = (uint64_t *)mdl_ext(mdl)->stats;
+  uint64_t *cst = (uint64_t *)&ctx->stats;
+  const uint64_t *dst = (const uint64_t *)d;
+  for (size_t i = 0; i < sizeof(api_stats_t) / sizeof(uint64_t); i++) {
+    if (dst[i] == 0)
+      continue;
+    cst[i] += dst[i];
+    __atomic_add_fetch(&mst[i], dst[i], __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Turns the counters of the model on, starting from 0, or off. Must
+ * not be called while the model is labeling.
+ */
+void api_set_stats(mdl_t *mdl, bool on) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  free(ext->stats);
+  ext->stats = NULL;
+  if (!on)
+    return;
+  ext->stats = xmalloc(sizeof(api_stats_t));
+  memset(ext->stats, 0, sizeof(api_stats_t));
+}
+
+/*
+ * Stores a snapshot of the model counters, all 0 if they are off. Can
+ * be called at any time.
+ */
+void api_get_stats(mdl_t *mdl, api_stats_t *stats) {
+  const uint64_t *mst = (const uint64_t *)mdl_ext(mdl)->stats;
+  uint64_t *dst = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(api_stats_t) / sizeof(uint64_t); i++)
+    dst[i] = mst != NULL ? __atomic_load_n(&mst[i], __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * Stores the counters of the labeling done with a context, with any
+ * model that had its counters on.
+ */
+void api_ctx_stats(const api_ctx_t *ctx, api_stats_t *stats) {
+  *stats = ctx->stats;
+}
+
+/* Counts the observations of the sequence just built */
+static void sts_feat(mdl_t *mdl, api_ctx_t *ctx, api_stats_t *d) {
+  d->obs += (uint64_t)ctx->len * mdl->reader->npats;
+  d->unk += ctx->nunk;
+}
+
+/* Instrumented api_decode, the label cache lookup counts as splitting */
+void sts_decode(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len) {
+  api_stats_t d = {0};
+  uint64_t t0 = sts_now();
+  ctx_split(ctx, buf, len, mdl->opt->check);
+  const bool hit = lbc_get(mdl, ctx);
+  uint64_t t1 = sts_now();
+  d.split = t1 - t0;
+  d.seqs = 1;
+  d.toks = ctx->len;
+  if (hit) {
+    d.hits = 1;
+    sts_add(mdl, ctx, &d);
+    return;
+  }
+  ctx_raw2seq(mdl, ctx, mdl->opt->check);
+  t0 = sts_now();
+  d.feat = t0 - t1;
+  sts_feat(mdl, ctx, &d);
+  ctx_viterbi(mdl, ctx);
+  lbc_put(mdl, ctx);
+  d.decode = sts_now() - t0;
+  sts_add(mdl, ctx, &d);
+}
+
+/* Instrumented api_label_cols, taking the columns counts as splitting */
+void sts_columns(mdl_t *mdl, api_ctx_t *ctx, const api_span_t cells[],
+                 uint32_t T, uint32_t C) {
+  api_stats_t d = {0};
+  const uint64_t t0 = sts_now();
+  ctx_columns(ctx, cells, T, C, mdl->opt->check);
+  const uint64_t t1 = sts_now();
+  ctx_raw2seq(mdl, ctx, mdl->opt->check);
+  const uint64_t t2 = sts_now();
+  ctx_viterbi(mdl, ctx);
+  d.split = t1 - t0;
+  d.feat = t2 - t1;
+  d.decode = sts_now() - t2;
+  d.seqs = 1;
+  d.toks = ctx->len;
+  sts_feat(mdl, ctx, &d);
+  sts_add(mdl, ctx, &d);
+}
+
+/* Instrumented api_label_nbest */
+uint32_t sts_nbest(mdl_t *mdl, api_ctx_t *ctx, const char *buf, size_t len,
+                   uint32_t n, bool post) {
+  api_stats_t d = {0};
+  const uint64_t t0 = sts_now();
+  ctx_split(ctx, buf, len, mdl->opt->check);
+  const uint64_t t1 = sts_now();
+  ctx_raw2seq(mdl, ctx, mdl->opt->check);
+  const uint64_t t2 = sts_now();
+  const uint32_t res = ctx_nbest(mdl, ctx, n, post);
+  d.split = t1 - t0;
+  d.feat = t2 - t1;
+  d.decode = sts_now() - t2;
+  d.seqs = 1;
+  d.toks = ctx->len;
+  sts_feat(mdl, ctx, &d);
+  sts_add(mdl, ctx, &d);
+  return res;
+}
+
+/* Instrumented ctx_output */
+const char *sts_output(mdl_t *mdl, api_ctx_t *ctx) {
+  api_stats_t d = {0};
+  const uint64_t t0 = sts_now();
+  const char *str = ctx_output(mdl, ctx);
+  d.output = sts_now() - t0;
+  sts_add(mdl, ctx, &d);
+  return str;
+}
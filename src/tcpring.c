@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * TCP ring transport
+ *
+ * The nodes of a training are arranged in a ring, each one connected to
+ * the next by a single TCP socket, and collectives pass data around it
+ * with the bandwidth optimal ring algorithms: an allreduce is a
+ * reduce-scatter followed by an allgather, in which every node sends
+ * and receives 2 (N-1) / N of the vector, whatever the number of
+ * nodes. Each part of the result is summed in the same order on one
+ * node and copied to the others, so all get bitwise identical values.
+ *
+ * Data is sent as is, so all nodes must share the same byte order and
+ * floating point format. They should also share the same instruction
+ * set, or the weights drift apart and are resynced, see dist.c.
+ */
+typedef struct tcp_s {
+  int       next, prev;   // Sockets to the next and previous node
+} tcp_t;
+
+/* Splits "host:port" in its two parts, the host is copied to buf */
+static const char *tcp_addr(const char *str, char *buf, size_t size) {
+  const char *sep = strrchr(str, ':');
+  if (sep == NULL || (size_t)(sep - str) >= size)
+    fatal("invalid node address '%s'", str);
+  memcpy(buf, str, sep - str);
+  buf[sep - str] = '\0';
+  return sep + 1;
+}
+
+static struct addrinfo *tcp_resolve(const char *str, bool passive) {
+  char host[256];
+  const char *port = tcp_addr(str, host, sizeof(host));
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  const int err = getaddrinfo(passive ? NULL : host, port, &hints, &res);
+  if (err != 0)
+    fatal("cannot resolve '%s': %s", str, gai_strerror(err));
+  return res;
+}
+
+static void tcp_setup(int fd) {
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Connects to the next node, retrying while it is not listening yet */
+static int tcp_connect(const char *str) {
+  struct addrinfo *res = tcp_resolve(str, false);
+  for (int tries = 0; tries < 600; tries++) {
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+      const int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        freeaddrinfo(res);
+        return fd;
+      }
+      close(fd);
+    }
+    const struct timespec nap = {0, 100000000};
+    nanosleep(&nap, NULL);
+  }
+  freeaddrinfo(res);
+  pfatal("cannot connect to node %s", str);
+  return -1;
+}
+
+static int tcp_listen(const char *str) {
+  struct addrinfo *res = tcp_resolve(str, true);
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 1) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    pfatal("cannot listen on %s", str);
+  return fd;
+}
+
+/*
+ * Sends slen bytes to the next node while receiving rlen bytes from the
+ * previous one. Both go on at once, so the ring cannot deadlock on full
+ * socket buffers.
+ */
+static void tcp_xfer(tcp_t *tcp, const void *sbuf, size_t slen, void *rbuf,
+                     size_t rlen) {
+  const char *s = sbuf;
+  char *r = rbuf;
+  while (slen != 0 || rlen != 0) {
+    struct pollfd fds[2];
+    nfds_t n = 0;
+    if (slen != 0)
+      fds[n++] = (struct pollfd){tcp->next, POLLOUT, 0};
+    if (rlen != 0)
+      fds[n++] = (struct pollfd){tcp->prev, POLLIN, 0};
+    if (poll(fds, n, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      pfatal("ring transport failed");
+    }
+    for (nfds_t i = 0; i < n; i++) {
+      if (fds[i].revents == 0)
+        continue;
+      if (fds[i].fd == tcp->next && slen != 0) {
+        const ssize_t k = send(tcp->next, s, slen, MSG_NOSIGNAL);
+        if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != EINTR)
+          pfatal("cannot send to next node");
+        if (k > 0) {
+          s += k;
+          slen -= k;
+        }
+      } else if (fds[i].fd == tcp->prev && rlen != 0) {
+        const ssize_t k = recv(tcp->prev, r, rlen, 0);
+        if (k == 0)
+          fatal("previous node closed the ring");
+        if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != EINTR)
+          pfatal("cannot receive from previous node");
+        if (k > 0) {
+          r += k;
+          rlen -= k;
+        }
+      }
+    }
+  }
+}
+
+/* Bounds of segment k of n values cut in N */
+static uint64_t tcp_seg(uint64_t n, uint32_t N, uint32_t k) {
+  return n * k / N;
+}
+
+static void tcp_allreduce(api_dist_t *dist, double x[], uint64_t n) {
+  tcp_t *tcp = dist->ud;
+  const uint32_t N = dist->size, r = dist->rank;
+  if (N == 1)
+    return;
+  double *tmp = xmalloc(sizeof(double) * (n / N + 1));
+
+  // Reduce-scatter: after N - 1 steps, segment r + 1 holds the sum of
+  // all the nodes
+  for (uint32_t s = 0; s < N - 1; s++) {
+    const uint32_t ks = (r + N - s) % N, kr = (r + N - s - 1) % N;
+    const uint64_t sb = tcp_seg(n, N, ks), se = tcp_seg(n, N, ks + 1);
+    const uint64_t rb = tcp_seg(n, N, kr), re = tcp_seg(n, N, kr + 1);
+    tcp_xfer(tcp, x + sb, sizeof(double) * (se - sb), tmp,
+             sizeof(double) * (re - rb));
+    for (uint64_t i = rb; i < re; i++)
+      x[i] += tmp[i - rb];
+  }
+  free(tmp);
+
+  // Allgather: pass the summed segments around the ring
+  for (uint32_t s = 0; s < N - 1; s++) {
+    const uint32_t ks = (r + 1 + N - s) % N, kr = (r + N - s) % N;
+    const uint64_t sb = tcp_seg(n, N, ks), se = tcp_seg(n, N, ks + 1);
+    const uint64_t rb = tcp_seg(n, N, kr), re = tcp_seg(n, N, kr + 1);
+    tcp_xfer(tcp, x + sb, sizeof(double) * (se - sb), x + rb,
+             sizeof(double) * (re - rb));
+  }
+}
+
+static void *tcp_allgather(api_dist_t *dist, const void *buf, size_t len,
+                           size_t lens[]) {
+  tcp_t *tcp = dist->ud;
+  const uint32_t N = dist->size, r = dist->rank;
+
+  // Everyone first learns the size of every block
+  uint64_t *sz = xmalloc(sizeof(uint64_t) * N);
+  sz[r] = len;
+  for (uint32_t s = 0; s < N - 1; s++) {
+    const uint32_t ks = (r + N - s) % N, kr = (r + N - s - 1) % N;
+    tcp_xfer(tcp, &sz[ks], sizeof(uint64_t), &sz[kr], sizeof(uint64_t));
+  }
+  size_t *off = xmalloc(sizeof(size_t) * (N + 1));
+  off[0] = 0;
+  for (uint32_t k = 0; k < N; k++) {
+    lens[k] = sz[k];
+    off[k + 1] = off[k] + sz[k];
+  }
+  free(sz);
+
+  char *out = xmalloc(off[N] + 1);
+  memcpy(out + off[r], buf, len);
+  for (uint32_t s = 0; s < N - 1; s++) {
+    const uint32_t ks = (r + N - s) % N, kr = (r + N - s - 1) % N;
+    tcp_xfer(tcp, out + off[ks], lens[ks], out + off[kr], lens[kr]);
+  }
+  free(off);
+  return out;
+}
+
+/*
+ * Connects this node, of the given rank, to the ring of size nodes at
+ * the addresses in nodes, as "host:port". The node listens on the port
+ * of its own address, and this returns once it is linked to both of
+ * its neighbours, so every node must be started with the same list.
+ */
+api_dist_t *api_new_dist_tcp(uint32_t rank, uint32_t size,
+                             const char *const nodes[]) {
+  if (size == 0 || rank >= size)
+    fatal("invalid node rank %"PRIu32" of %"PRIu32, rank, size);
+  tcp_t *tcp = xmalloc(sizeof(tcp_t));
+  tcp->next = tcp->prev = -1;
+  if (size > 1) {
+    const int lfd = tcp_listen(nodes[rank]);
+    tcp->next = tcp_connect(nodes[(rank + 1) % size]);
+    tcp->prev = accept(lfd, NULL, NULL);
+    if (tcp->prev < 0)
+      pfatal("cannot accept previous node");
+    close(lfd);
+    tcp_setup(tcp->next);
+    tcp_setup(tcp->prev);
+  }
+  api_dist_t *dist = xmalloc(sizeof(api_dist_t));
+  dist->rank = rank;
+  dist->size = size;
+  dist->ud = tcp;
+  dist->allreduce = tcp_allreduce;
+  dist->allgather = tcp_allgather;
+  return dist;
+}
+
+/* Closes the ring connections of a transport from api_new_dist_tcp */
+void api_free_dist_tcp(api_dist_t *dist) {
+  tcp_t *tcp = dist->ud;
+  if (tcp->next >= 0)
+    close(tcp->next);
+  if (tcp->prev >= 0)
+    close(tcp->prev);
+  free(tcp);
+  free(dist);
+}
@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "quark.h"
+#include "reader.h"
+#include "thread.h"
+#include "tools.h"
+#include "api.h"
+#include "mdlext.h"
+
+/*
+ * Parallel text models
+ *
+ * These read and write the same text files as mdl_load and mdl_save.
+ * In large models almost all of the file is the observation list and
+ * the weights, so those two sections are handled here. The small
+ * reader section before them still goes through wapiti. Hashed models
+ * save a tag in place of the observations, see features.c, which only
+ * this loader understands.
+ *
+ * To save, items are formatted in chunks by opt->nthread workers, each
+ * into its own buffer. The buffers are then written in order. This is
+ * done a few chunks per worker at a time, so memory use stays bounded.
+ *
+ * To load, the whole file is read into memory. The observation strings
+ * are found in place and added to the quark in order, since it assigns
+ * ids in insertion order. The weight lines are cut in chunks at line
+ * boundaries and parsed by the workers.
+ */
+
+static const uint64_t txt_chunk = 16384;   // Items per saving chunk
+static const char    *txt_err = "invalid model format";
+
+/* Appends formatted text to a growing buffer */
+static void txt_printf(char **buf, size_t *size, size_t *len,
+                       const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    const int n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      fatal("cannot format model");
+    if (*len + n < *size) {
+      *len += n;
+      return;
+    }
+    *size = max(*size * 2, *len + n + 1);
+    *buf = xrealloc(*buf, *size);
+  }
+}
+
+/* State of a round of saving: J chunks of step items from first */
+typedef struct txt_save_s {
+  mdl_t    *mdl;
+  bool      obs;     // Observations, else weights
+  uint64_t  first, last, step;
+  char    **buf;     // [J]
+  size_t   *size;    // [J]
+  size_t   *len;     // [J]
+} txt_save_t;
+
+static void txt_saver(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  txt_save_t *sav = ud;
+  const mdl_t *mdl = sav->mdl;
+  const qrk_t *obs = mdl->reader->obs;
+  uint32_t pos, n;
+  (void)id;
+  (void)cnt;
+  while (mth_getjob(job, &n, &pos)) {
+    for (uint32_t j = pos; j < pos + n; j++) {
+      const uint64_t beg = sav->first + j * sav->step;
+      const uint64_t end = min(beg + sav->step, sav->last);
+      sav->len[j] = 0;
+      for (uint64_t i = beg; i < end; i++) {
+        if (sav->obs) {
+          const char *str = qrk_id2str(obs, i);
+          txt_printf(&sav->buf[j], &sav->size[j], &sav->len[j], "%d:%s,\n",
+                     (int)strlen(str), str);
+        } else if (mdl->theta[i] != 0.0) {
+          txt_printf(&sav->buf[j], &sav->size[j], &sav->len[j],
+                     "%"PRIu64"=%la\n", i, mdl->theta[i]);
+        }
+      }
+    }
+  }
+}
+
+/* Formats items [0, N) of a section in parallel and writes them */
+static void txt_section(mdl_t *mdl, FILE *file, bool obs, uint64_t N) {
+  const uint32_t W = max(mdl->opt->nthread, 1u), J = 4 * W;
+  txt_save_t sav = {mdl, obs, 0, N, txt_chunk, NULL, NULL, NULL};
+  sav.buf  = xmalloc(sizeof(char *) * J);
+  sav.size = xmalloc(sizeof(size_t) * J);
+  sav.len  = xmalloc(sizeof(size_t) * J);
+  for (uint32_t j = 0; j < J; j++) {
+    sav.size[j] = 4096;
+    sav.buf[j] = xmalloc(sav.size[j]);
+  }
+  void **uds = xmalloc(sizeof(void *) * W);
+  for (uint32_t w = 0; w < W; w++)
+    uds[w] = &sav;
+
+  for (sav.first = 0; sav.first < N; sav.first += J * txt_chunk) {
+    const uint64_t left = (N - sav.first + txt_chunk - 1) / txt_chunk;
+    const uint32_t cnt = min(left, (uint64_t)J);
+    mth_spawn(txt_saver, W, uds, cnt, 1);
+    for (uint32_t j = 0; j < cnt; j++)
+      if (fwrite(sav.buf[j], 1, sav.len[j], file) != sav.len[j])
+        pfatal("cannot write to file");
+  }
+
+  for (uint32_t j = 0; j < J; j++)
+    free(sav.buf[j]);
+  free(uds);
+  free(sav.len);
+  free(sav.size);
+  free(sav.buf);
+}
+
+/* Saves the model in wapiti's text format, like mdl_save */
+void txt_save(mdl_t *mdl, FILE *file) {
+  const uint64_t F = mdl->nftr;
+  uint64_t nact = 0;
+  for (uint64_t f = 0; f < F; f++)
+    if (mdl->theta[f] != 0.0)
+      nact++;
+  if (fprintf(file, "#mdl#%d#%"PRIu64"\n", mdl->type, nact) < 0)
+    pfatal("cannot write to file");
+
+  // Let wapiti write the reader with an empty observation quark, and
+  // replace that last quark with the real one
+  static const char eoq[] = "#qrk#0\n";
+  rdr_t rdr = *mdl->reader;
+  rdr.obs = qrk_new();
+  char *head = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&head, &len);
+  if (mem == NULL)
+    pfatal("cannot save model");
+  rdr_save(&rdr, mem);
+  fclose(mem);
+  qrk_free(rdr.obs);
+  const size_t hlen = len - (sizeof(eoq) - 1);
+  if (len < sizeof(eoq) - 1 || strcmp(head + hlen, eoq))
+    fatal("unexpected reader format");
+  if (fwrite(head, 1, hlen, file) != hlen)
+    pfatal("cannot write to file");
+  free(head);
+
+  // Hashed models only save their tag in place of the observations
+  if (mdl_ext(mdl)->hbits != 0) {
+    char tag[fsp_tagsz];
+    fsp_tag(mdl, tag);
+    if (fprintf(file, "#qrk#1\n%d:%s,\n", (int)strlen(tag), tag) < 0)
+      pfatal("cannot write to file");
+  } else {
+    const uint64_t O = qrk_count(mdl->reader->obs);
+    if (fprintf(file, "#qrk#%"PRIu64"\n", O) < 0)
+      pfatal("cannot write to file");
+    txt_section(mdl, file, true, O);
+  }
+  txt_section(mdl, file, false, F);
+}
+
+/* Skips one line */
+static char *txt_line(char *pos, const char *end) {
+  char *nl = memchr(pos, '\n', end - pos);
+  if (nl == NULL)
+    fatal(txt_err);
+  return nl + 1;
+}
+
+/* Reads a "#tag#count" line and returns the count */
+static uint64_t txt_count(char **pos, const char *end, const char *tag) {
+  const size_t len = strlen(tag);
+  char *num;
+  if ((size_t)(end - *pos) < len || memcmp(*pos, tag, len))
+    fatal(txt_err);
+  const uint64_t cnt = strtoull(*pos + len, &num, 10);
+  if (num == *pos + len)
+    fatal(txt_err);
+  *pos = txt_line(num, end);
+  return cnt;
+}
+
+/*
+ * Reads a "len:str," string as written by wapiti and returns it. With
+ * cut, the string is NUL terminated in place.
+ */
+static char *txt_str(char **pos, const char *end, bool cut) {
+  char *str;
+  const unsigned long len = strtoul(*pos, &str, 10);
+  if (str == *pos || str >= end || *str != ':'
+      || (size_t)(end - str) < len + 3 || str[len + 1] != ',')
+    fatal(txt_err);
+  str++;
+  if (cut)
+    str[len] = '\0';
+  *pos = str + len + 2;
+  return str;
+}
+
+/* State of the weights parsing: J chunks of the weights section */
+typedef struct txt_load_s {
+  mdl_t     *mdl;
+  char     **beg;    // [J+1]  chunk boundaries
+  uint64_t  *cnt;    // [J]    lines read
+  bool      *bad;    // [J]    a line was invalid
+} txt_load_t;
+
+static void txt_loader(job_t *job, uint32_t id, uint32_t cnt, void *ud) {
+  txt_load_t *ld = ud;
+  mdl_t *mdl = ld->mdl;
+  uint32_t pos, n;
+  (void)id;
+  (void)cnt;
+  while (mth_getjob(job, &n, &pos)) {
+    for (uint32_t j = pos; j < pos + n; j++) {
+      char *cur = ld->beg[j];
+      const char *end = ld->beg[j + 1];
+      ld->cnt[j] = 0;
+      ld->bad[j] = false;
+      while (cur < end) {
+        char *sep, *num;
+        const uint64_t f = strtoull(cur, &sep, 10);
+        if (sep == cur || *sep != '=') {
+          ld->bad[j] = true;
+          break;
+        }
+        const double v = strtod(sep + 1, &num);
+        if (num == sep + 1 || f >= mdl->nftr || (num < end && *num != '\n')) {
+          ld->bad[j] = true;
+          break;
+        }
+        mdl->theta[f] = v;
+        ld->cnt[j]++;
+        cur = num + 1;
+      }
+    }
+  }
+}
+
+/* Loads a model in wapiti's text format, like mdl_load */
+void txt_load(mdl_t *mdl, FILE *file) {
+  size_t size = 1 << 20, len = 0, n;
+  char *buf = xmalloc(size);
+  while ((n = fread(buf + len, 1, size - len - 1, file)) != 0) {
+    len += n;
+    if (len + 1 == size) {
+      size *= 2;
+      buf = xrealloc(buf, size);
+    }
+  }
+  if (ferror(file))
+    pfatal("cannot read model file");
+  buf[len] = '\0';
+  char *pos = buf, *end = buf + len;
+
+  // Header, with or without the model type
+  int type, hlen = 0;
+  uint64_t nact;
+  if (sscanf(pos, "#mdl#%d#%"SCNu64"%n", &type, &nact, &hlen) == 2)
+    mdl->type = type;
+  else if (sscanf(pos, "#mdl#%"SCNu64"%n", &nact, &hlen) == 1)
+    mdl->type = 0;
+  else
+    fatal(txt_err);
+  pos = txt_line(pos + hlen, end);
+
+  // Find where the reader observations start, and let wapiti load the
+  // reader up to there, followed by an empty quark
+  char *rdr = pos;
+  if (end - pos < 5 || memcmp(pos, "#rdr#", 5))
+    fatal(txt_err);
+  const uint32_t npats = strtoul(pos + 5, NULL, 10);
+  pos = txt_line(pos, end);
+  for (uint32_t p = 0; p < npats; p++)
+    txt_str(&pos, end, false);
+  const uint64_t Y = txt_count(&pos, end, "#qrk#");
+  for (uint64_t y = 0; y < Y; y++)
+    txt_str(&pos, end, false);
+  static const char eoq[] = "#qrk#0\n";
+  const size_t rlen = pos - rdr;
+  char *head = xmalloc(rlen + sizeof(eoq));
+  memcpy(head, rdr, rlen);
+  memcpy(head + rlen, eoq, sizeof(eoq));
+  FILE *mem = fmemopen(head, rlen + sizeof(eoq) - 1, "r");
+  if (mem == NULL)
+    pfatal("cannot load model");
+  rdr_load(mdl->reader, mem);
+  fclose(mem);
+  free(head);
+
+  // Observations, in id order, or the tag of a hashed model
+  qrk_t *obs = mdl->reader->obs;
+  const uint64_t O = txt_count(&pos, end, "#qrk#");
+  const bool lock = qrk_lock(obs, false);
+  for (uint64_t o = 0; o < O; o++) {
+    const char *str = txt_str(&pos, end, true);
+    if (O == 1 && fsp_load(mdl, str))
+      break;
+    if (qrk_str2id(obs, str) != o)
+      fatal(txt_err);
+  }
+  qrk_lock(obs, lock);
+  fsp_sync(mdl);
+
+  // Weights, cut in chunks at line boundaries
+  const uint32_t W = max(mdl->opt->nthread, 1u), J = 4 * W;
+  txt_load_t ld = {mdl, NULL, NULL, NULL};
+  ld.beg = xmalloc(sizeof(char *) * (J + 1));
+  ld.cnt = xmalloc(sizeof(uint64_t) * J);
+  ld.bad = xmalloc(sizeof(bool) * J);
+  while (end > pos && (end[-1] == '\n' || end[-1] == ' '))
+    end--;
+  ld.beg[0] = pos;
+  for (uint32_t j = 1; j < J; j++) {
+    char *cut = ld.beg[j - 1];
+    if (cut < end)
+      cut = max(cut, pos + (end - pos) / J * j);
+    char *nl = memchr(cut, '\n', end - cut);
+    ld.beg[j] = nl != NULL ? nl + 1 : end;
+  }
+  ld.beg[J] = end;
+  void **uds = xmalloc(sizeof(void *) * W);
+  for (uint32_t w = 0; w < W; w++)
+    uds[w] = &ld;
+  mth_spawn(txt_loader, W, uds, J, 1);
+  uint64_t cnt = 0;
+  for (uint32_t j = 0; j < J; j++) {
+    if (ld.bad[j])
+      fatal(txt_err);
+    cnt += ld.cnt[j];
+  }
+  if (cnt != nact)
+    fatal(txt_err);
+
+  free(uds);
+  free(ld.bad);
+  free(ld.cnt);
+  free(ld.beg);
+  free(buf);
+}
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wapiti.h"
+#include "model.h"
+#include "tools.h"
+#include "api.h"
+#include "program.h"
+#include "context.h"
+#include "mdlext.h"
+
+/*
+ * Token observations cache
+ *
+ * The observations of local patterns, the ones only reading the
+ * current position like "u:%x[0,0]", are the same every time a token
+ * appears. With natural language most positions hold one of a few
+ * frequent tokens, so the model keeps the ids of these observations
+ * for the tokens it has seen, and sequence construction only runs the
+ * other patterns for them.
+ *
+ * A token is identified by the columns local patterns read, and maps
+ * to the id of each local pattern observation with the first char of
+ * its string, which gives its kind, or 0 if it is unknown. Entries are
+ * never evicted: once the cache is full new tokens are simply not
+ * added, frequent ones are usually seen first. Readers share the lock,
+ * so labeling threads only serialize to add tokens, but every lookup
+ * still writes the cache line of the lock, which all of them share. As
+ * this can cost more than it saves with many threads, the cache is
+ * opt-in.
+ *
+ * Ids are only valid for one set of observations and patterns, so the
+ * cache is emptied with ext_thaw, which comes first in anything that
+ * changes them, and when the program is rebuilt.
+ */
+typedef struct tkc_ent_s tkc_ent_t;
+struct tkc_ent_s {
+  tkc_ent_t *next;        // Next entry in the same bucket
+  uint64_t   hash;
+  uint32_t   keylen;
+  uint64_t  *ids;         // [L]  stored after the key
+  char      *kind;        // [L]  stored after the ids
+  char       key[];
+};
+
+struct tkc_s {
+  pthread_rwlock_t lock;
+  uint32_t         size, cnt;
+  uint64_t         mask;
+  tkc_ent_t      **tbl;
+};
+
+/* FNV-1a with a final mix, over len bytes */
+static uint64_t tkc_hash(const char *str, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Releases all the entries */
+static void tkc_flush(tkc_t *tkc) {
+  for (uint64_t b = 0; b <= tkc->mask; b++) {
+    tkc_ent_t *ent = tkc->tbl[b];
+    while (ent != NULL) {
+      tkc_ent_t *next = ent->next;
+      free(ent);
+      ent = next;
+    }
+    tkc->tbl[b] = NULL;
+  }
+  tkc->cnt = 0;
+}
+
+/*
+ * Sets the number of tokens the model keeps the observations of. 0
+ * disables the cache, any other size starts with an empty one. Models
+ * have no cache until one is set.
+ */
+void api_set_token_cache(mdl_t *mdl, uint32_t size) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  tkc_free(mdl);
+  if (size == 0)
+    return;
+  tkc_t *tkc = xmalloc(sizeof(tkc_t));
+  pthread_rwlock_init(&tkc->lock, NULL);
+  tkc->size = size;
+  tkc->cnt = 0;
+  tkc->mask = 15;
+  while (tkc->mask + 1 < size)
+    tkc->mask = tkc->mask * 2 + 1;
+  tkc->tbl = xmalloc(sizeof(tkc_ent_t *) * (tkc->mask + 1));
+  memset(tkc->tbl, 0, sizeof(tkc_ent_t *) * (tkc->mask + 1));
+  ext->tkc = tkc;
+}
+
+/* Drops the cache */
+void tkc_free(mdl_t *mdl) {
+  mdl_ext_t *ext = mdl_ext(mdl);
+  tkc_t *tkc = ext->tkc;
+  if (tkc == NULL)
+    return;
+  tkc_flush(tkc);
+  pthread_rwlock_destroy(&tkc->lock);
+  free(tkc->tbl);
+  free(tkc);
+  ext->tkc = NULL;
+}
+
+/* Empties the cache, after the observations or patterns changed */
+void tkc_clear(mdl_t *mdl) {
+  tkc_t *tkc = mdl_ext(mdl)->tkc;
+  if (tkc == NULL)
+    return;
+  pthread_rwlock_wrlock(&tkc->lock);
+  tkc_flush(tkc);
+  pthread_rwlock_unlock(&tkc->lock);
+}
+
+/*
+ * Builds the key of the token at position at in ctx->tkey: each of its
+ * first ncols columns as its length followed by its bytes. Cells of
+ * column input may hold spaces, so a separator would let two tokens
+ * share a key. Returns false if the token is too short, the patterns
+ * will fail on it.
+ */
+static bool tkc_key(api_ctx_t *ctx, uint32_t at, uint32_t ncols) {
+  if (ctx->cnts[at] < ncols)
+    return false;
+  size_t pos = 0;
+  ctx->tkey = ctx_grow(ctx->tkey, &ctx->tkeysz, 1, 1);
+  for (uint32_t c = 0; c < ncols; c++) {
+    const api_span_t cell = ctx->cells[ctx->first[at] + c];
+    const uint32_t len = cell.len;
+    ctx->tkey = ctx_grow(ctx->tkey, &ctx->tkeysz,
+                         pos + sizeof(len) + len, 1);
+    memcpy(ctx->tkey + pos, &len, sizeof(len));
+    pos += sizeof(len);
+    memcpy(ctx->tkey + pos, cell.str, len);
+    pos += len;
+  }
+  ctx->tkeylen = pos;
+  ctx->tkeyhash = tkc_hash(ctx->tkey, pos);
+  return true;
+}
+
+/* Returns the address of the pointer to the entry of the context key */
+static tkc_ent_t **tkc_find(tkc_t *tkc, const api_ctx_t *ctx) {
+  tkc_ent_t **ref = &tkc->tbl[ctx->tkeyhash & tkc->mask];
+  while (*ref != NULL) {
+    const tkc_ent_t *ent = *ref;
+    if (ent->hash == ctx->tkeyhash && ent->keylen == ctx->tkeylen
+        && !memcmp(ent->key, ctx->tkey, ctx->tkeylen))
+      break;
+    ref = &(*ref)->next;
+  }
+  return ref;
+}
+
+/*
+ * Looks up the token at position at. On a hit, returns the ids of the
+ * local patterns observations, in reader order, and stores their kinds
+ * in kind. They stay valid until the cache is emptied.
+ *
+ * On a miss, returns NULL and, if the token can be added, leaves its
+ * key in the context for tkc_put.
+ */
+const uint64_t *tkc_get(mdl_t *mdl, api_ctx_t *ctx, uint32_t at,
+                        const char **kind) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  tkc_t *tkc = ext->tkc;
+  ctx->tkeyok = false;
+  if (tkc == NULL || ext->prg->nlocal == 0)
+    return NULL;
+  if (!tkc_key(ctx, at, ext->prg->ncols))
+    return NULL;
+  pthread_rwlock_rdlock(&tkc->lock);
+  const tkc_ent_t *ent = *tkc_find(tkc, ctx);
+  const bool full = tkc->cnt >= tkc->size;
+  pthread_rwlock_unlock(&tkc->lock);
+  if (ent == NULL) {
+    ctx->tkeyok = !full;
+    return NULL;
+  }
+  *kind = ent->kind;
+  return ent->ids;
+}
+
+/*
+ * Adds the ids and kinds in ctx->tids and ctx->tkind for the token of
+ * the last missed tkc_get, if it can be added.
+ */
+void tkc_put(mdl_t *mdl, api_ctx_t *ctx) {
+  const mdl_ext_t *ext = mdl_ext(mdl);
+  tkc_t *tkc = ext->tkc;
+  if (tkc == NULL || !ctx->tkeyok)
+    return;
+  const uint32_t L = ext->prg->nlocal;
+  const size_t keysz = (ctx->tkeylen + 7) / 8 * 8;
+  tkc_ent_t *ent = xmalloc(sizeof(tkc_ent_t) + keysz
+                           + sizeof(uint64_t) * L + L);
+  ent->hash = ctx->tkeyhash;
+  ent->keylen = ctx->tkeylen;
+  ent->ids = (uint64_t *)(ent->key + keysz);
+  ent->kind = (char *)(ent->ids + L);
+  memcpy(ent->key, ctx->tkey, ctx->tkeylen);
+  memcpy(ent->ids, ctx->tids, sizeof(uint64_t) * L);
+  memcpy(ent->kind, ctx->tkind, L);
+
+  pthread_rwlock_wrlock(&tkc->lock);
+  tkc_ent_t **ref = tkc_find(tkc, ctx);
+  if (*ref != NULL || tkc->cnt >= tkc->size) {
+    // Another thread added it, or filled the cache, in the meantime
+    pthread_rwlock_unlock(&tkc->lock);
+    free(ent);
+    return;
+  }
+  ent->next = NULL;
+  *ref = ent;
+  tkc->cnt++;
+  pthread_rwlock_unlock(&tkc->lock);
+}